@@ -0,0 +1,61 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_ARCH_CONFIG_HH_
+#define LILOS_ARCH_CONFIG_HH_
+
+/*
+ * Architecture parameters for 8-bit AVR.
+ */
+
+#include <stddef.h>
+#include <avr/io.h>
+
+#include <lilos/util.hh>
+
+#ifdef LILOS_PREEMPTIVE
+/*
+ * A preempted task is switched out from inside an interrupt handler, so its
+ * stack holds the handler's frame (up to 18 bytes, plus whatever the handler
+ * calls) as well as the saved context.
+ */
+static const size_t kMinStack = 96;
+#else
+// The smallest sensible task stack: a saved context plus a little room.
+static const size_t kMinStack = 48;
+#endif
+
+namespace lilos {
+
+// The idle task's stack.  It calls nothing much, but interrupts land on it.
+#ifdef LILOS_PREEMPTIVE
+static const size_t kIdleStackSize = 64;
+#else
+static const size_t kIdleStackSize = 32;
+#endif
+
+// What yieldTo() pushes: its return address and the 21-byte saved context.
+static const size_t kArchSwitchFrame = 23;
+
+ALWAYS_INLINE uint8_t *archStackPointer() {
+  return (uint8_t *) (uintptr_t) SP;
+}
+
+// Whether interrupts are enabled -- that is, whether we're in a task, outside
+// any critical section, rather than in an ISR.
+ALWAYS_INLINE bool archInterruptsEnabled() {
+  return SREG & _BV(SREG_I);
+}
+
+// Whether the state saved by ATOMIC_BLOCK(ATOMIC_RESTORESTATE) had interrupts
+// enabled.
+ALWAYS_INLINE bool archInterruptsWereEnabled(uint8_t sreg) {
+  return sreg & _BV(SREG_I);
+}
+
+}  // namespace lilos
+
+#endif  // LILOS_ARCH_CONFIG_HH_
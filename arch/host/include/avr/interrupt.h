@@ -0,0 +1,23 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_HOST_AVR_INTERRUPT_H_
+#define LILOS_HOST_AVR_INTERRUPT_H_
+
+/*
+ * Stands in for avr-libc's <avr/interrupt.h> on the host, where "interrupts"
+ * are signals.  See <lilos/arch_config.hh>.  There's no ISR() macro: host
+ * interrupt handlers are ordinary functions, registered with
+ * hostAttachInterrupt().
+ */
+
+#include <avr/io.h>
+#include <lilos/arch_config.hh>
+
+#define cli() lilos::hostDisableInterrupts()
+#define sei() lilos::hostRestoreInterrupts(true)
+
+#endif  // LILOS_HOST_AVR_INTERRUPT_H_
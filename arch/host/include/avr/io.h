@@ -0,0 +1,23 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_HOST_AVR_IO_H_
+#define LILOS_HOST_AVR_IO_H_
+
+/*
+ * Stands in for avr-libc's <avr/io.h> on the host.  There are no peripherals
+ * here, only a block of memory for the IO space, so that code poking at GPIO
+ * pins still compiles and runs.
+ */
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+extern volatile uint8_t lilos_host_io[64];
+#define _SFR_IO8(addr) (lilos_host_io[(addr)])
+
+#endif  // LILOS_HOST_AVR_IO_H_
@@ -0,0 +1,30 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_HOST_AVR_PGMSPACE_H_
+#define LILOS_HOST_AVR_PGMSPACE_H_
+
+/*
+ * Stands in for avr-libc's <avr/pgmspace.h> on the host, which has only one
+ * address space: program memory is just memory.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+typedef char prog_char;
+
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+#define pgm_read_word(addr) (*(const uint16_t *) (addr))
+#define pgm_read_dword(addr) (*(const uint32_t *) (addr))
+
+#define strlen_P strlen
+#define memcpy_P memcpy
+
+#endif  // LILOS_HOST_AVR_PGMSPACE_H_
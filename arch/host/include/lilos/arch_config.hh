@@ -0,0 +1,101 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_ARCH_CONFIG_HH_
+#define LILOS_ARCH_CONFIG_HH_
+
+/*
+ * Architecture parameters for running the kernel as an ordinary x86-64 Linux
+ * process -- for benchmarking, load testing, and debugging application logic
+ * with the usual tools.
+ *
+ * Tasks have their own stacks and switch contexts much as they do on the AVR.
+ * Signals play the part of interrupts, and their handlers run on whichever
+ * task stack is current.  The AVR's I flag is emulated in software: while it's
+ * clear, a signal handler merely notes that its interrupt is pending, and the
+ * handler runs when the flag is next set.  This keeps cli() and sei() down to
+ * a couple of instructions rather than a system call.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+
+#include <lilos/util.hh>
+
+/*
+ * The smallest sensible task stack.  Much larger than on the AVR: signal
+ * handlers run on task stacks, and the kernel pushes a few kilobytes of
+ * processor state before calling them.
+ */
+static const size_t kMinStack = 16384;
+
+namespace lilos {
+
+static const size_t kIdleStackSize = kMinStack;
+
+typedef void (*isr_t)();
+
+/*
+ * Arranges for isr to be run, as an interrupt handler, whenever the given
+ * signal arrives.  Signal 0 attaches an interrupt that can only be triggered
+ * with hostRaiseInterrupt().  Returns an interrupt number for use with
+ * hostRaiseInterrupt().  Call before startTasking().
+ */
+uint8_t hostAttachInterrupt(int signo, isr_t isr);
+
+/*
+ * Marks an interrupt pending, as a peripheral would set its interrupt flag.
+ * The handler runs as soon as interrupts are enabled.
+ */
+void hostRaiseInterrupt(uint8_t irq);
+
+// Runs pending interrupt handlers.  Called with interrupts enabled.
+void hostServiceInterrupts();
+
+// The emulated I flag, and whether any interrupts are pending.
+extern volatile sig_atomic_t hostInterruptsOn;
+extern volatile sig_atomic_t hostInterruptsPending;
+
+// Clears the I flag, returning its previous state.
+ALWAYS_INLINE bool hostDisableInterrupts() {
+  bool was = hostInterruptsOn;
+  hostInterruptsOn = false;
+  asm volatile ("" ::: "memory");
+  return was;
+}
+
+// Sets the I flag to the given state, servicing any pending interrupts.
+ALWAYS_INLINE void hostRestoreInterrupts(bool on) {
+  asm volatile ("" ::: "memory");
+  hostInterruptsOn = on;
+  if (on && hostInterruptsPending) hostServiceInterrupts();
+}
+
+/*
+ * What yieldTo() pushes: its return address and frame, and the call into the
+ * switch routine with the six registers it saves.  The frame's size is up to
+ * the compiler, so this leaves room to spare.
+ */
+static const size_t kArchSwitchFrame = 256;
+
+ALWAYS_INLINE uint8_t *archStackPointer() {
+  uint8_t *sp;
+  asm volatile ("mov %%rsp, %0" : "=r"(sp));
+  return sp;
+}
+
+ALWAYS_INLINE bool archInterruptsEnabled() {
+  return hostInterruptsOn;
+}
+
+ALWAYS_INLINE bool archInterruptsWereEnabled(bool saved) {
+  return saved;
+}
+
+}  // namespace lilos
+
+#endif  // LILOS_ARCH_CONFIG_HH_
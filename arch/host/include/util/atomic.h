@@ -0,0 +1,33 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_HOST_UTIL_ATOMIC_H_
+#define LILOS_HOST_UTIL_ATOMIC_H_
+
+/*
+ * Stands in for avr-libc's <util/atomic.h> on the host.  Like the original,
+ * the saved interrupt state is restored by a cleanup handler, so that it's
+ * safe to return or break out of the block.
+ */
+
+#include <avr/interrupt.h>
+
+static inline void __iRestore(const bool *state) {
+  lilos::hostRestoreInterrupts(*state);
+}
+
+static inline void __iSeiParam(const bool *) {
+  lilos::hostRestoreInterrupts(true);
+}
+
+#define ATOMIC_RESTORESTATE \
+  bool sreg_save __attribute__((__cleanup__(__iRestore))) = cli()
+#define ATOMIC_FORCEON \
+  bool sreg_save __attribute__((__cleanup__(__iSeiParam))) = cli()
+
+#define ATOMIC_BLOCK(type) for (type, __ToDo = true; __ToDo; __ToDo = false)
+
+#endif  // LILOS_HOST_UTIL_ATOMIC_H_
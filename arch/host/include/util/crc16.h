@@ -0,0 +1,29 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_HOST_UTIL_CRC16_H_
+#define LILOS_HOST_UTIL_CRC16_H_
+
+/*
+ * Stands in for avr-libc's <util/crc16.h> on the host.  Only the CRC used by
+ * the kernel is provided, with the C equivalent avr-libc documents.
+ */
+
+#include <stdint.h>
+
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data) {
+  crc ^= (uint16_t) data << 8;
+  for (int i = 0; i < 8; i++) {
+    if (crc & 0x8000) {
+      crc = (crc << 1) ^ 0x1021;
+    } else {
+      crc <<= 1;
+    }
+  }
+  return crc;
+}
+
+#endif  // LILOS_HOST_UTIL_CRC16_H_
@@ -0,0 +1,19 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_HOST_UTIL_DELAY_H_
+#define LILOS_HOST_UTIL_DELAY_H_
+
+/*
+ * Stands in for avr-libc's <util/delay.h> on the host.
+ */
+
+#include <unistd.h>
+
+static inline void _delay_us(double us) { usleep((useconds_t) us); }
+static inline void _delay_ms(double ms) { usleep((useconds_t) (ms * 1000)); }
+
+#endif  // LILOS_HOST_UTIL_DELAY_H_
@@ -0,0 +1,233 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <avr/io.h>
+
+#include <lilos/arch.hh>
+
+volatile uint8_t lilos_host_io[64];
+
+/*
+ * Context save/restore
+ *
+ * As on the AVR, only the registers that the x86-64 calling convention makes
+ * callee-saved need saving: the compiler has already saved the rest before
+ * calling yieldTo.  A task's saved context is those registers, pushed on its
+ * stack, topped by the address to resume at.  A new task "resumes" at
+ * lilos_host_trampoline, with its entry point in r12.
+ */
+asm (
+  ".text \n\t"
+  ".globl lilos_host_switch \n\t"
+  ".type lilos_host_switch, @function \n"
+  "lilos_host_switch: \n\t"         // (stack_t *save, stack_t restore)
+  "pushq %rbp \n\t"
+  "pushq %rbx \n\t"
+  "pushq %r12 \n\t"
+  "pushq %r13 \n\t"
+  "pushq %r14 \n\t"
+  "pushq %r15 \n\t"
+  "movq %rsp, (%rdi) \n\t"
+  "movq %rsi, %rsp \n"
+  "lilos_host_resume: \n\t"
+  "popq %r15 \n\t"
+  "popq %r14 \n\t"
+  "popq %r13 \n\t"
+  "popq %r12 \n\t"
+  "popq %rbx \n\t"
+  "popq %rbp \n\t"
+  "ret \n\t"
+
+  ".globl lilos_host_start \n\t"
+  ".type lilos_host_start, @function \n"
+  "lilos_host_start: \n\t"          // (stack_t restore)
+  "movq %rdi, %rsp \n\t"
+  "jmp lilos_host_resume \n\t"
+
+  ".globl lilos_host_trampoline \n\t"
+  ".type lilos_host_trampoline, @function \n"
+  "lilos_host_trampoline: \n\t"
+  "movq %r12, %rdi \n\t"
+  "andq $-16, %rsp \n\t"
+  "call lilos_host_task_entry \n\t"
+  "ud2 \n\t"
+
+  ".globl lilos_host_call_on_stack \n\t"
+  ".type lilos_host_call_on_stack, @function \n"
+  "lilos_host_call_on_stack: \n\t"  // (void (*fn)(void *), void *arg, sp)
+  "movq %rdx, %rsp \n\t"
+  "andq $-16, %rsp \n\t"
+  "movq %rdi, %rax \n\t"
+  "movq %rsi, %rdi \n\t"
+  "call *%rax \n\t"
+  "ud2 \n\t"
+);
+
+extern "C" {
+void lilos_host_switch(lilos::stack_t *save, lilos::stack_t restore);
+NORETURN lilos_host_start(lilos::stack_t restore);
+void lilos_host_trampoline();
+NORETURN lilos_host_call_on_stack(void (*fn)(void *), void *arg, void *sp);
+
+NORETURN lilos_host_task_entry(lilos::main_t entry) {
+  lilos::hostRestoreInterrupts(true);
+  entry();
+}
+}
+
+namespace lilos {
+
+stack_t archInitialContext(main_t entry, uint8_t *stack, size_t stackSize) {
+  uintptr_t *sp = (uintptr_t *) ((uintptr_t) (stack + stackSize) & ~15UL);
+
+  *--sp = 0;  // Padding, where the trampoline's return address would be.
+  *--sp = (uintptr_t) lilos_host_trampoline;
+  *--sp = 0;  // rbp
+  *--sp = 0;  // rbx
+  *--sp = (uintptr_t) entry;  // r12
+  *--sp = 0;  // r13
+  *--sp = 0;  // r14
+  *--sp = 0;  // r15
+
+  return (stack_t) sp;
+}
+
+NORETURN archStartTasking(Task *first) {
+  lilos_host_start(first->sp());
+}
+
+void yieldTo(Task *next) {
+  // The I flag is part of a task's context, as SREG is on the AVR.  Here it
+  // lives in a local, on the stack of the task being switched out.
+  bool on = hostDisableInterrupts();
+
+  Task *prev = _currentTask;
+  _currentTask = next;
+  lilos_host_switch(&prev->sp(), next->sp());
+
+  hostRestoreInterrupts(on);
+}
+
+uintptr_t archSavedPC(Task *task) {
+  return ((uintptr_t *) task->sp())[6];  // Above the six saved registers.
+}
+
+
+/*
+ * Interrupt emulation
+ */
+
+volatile sig_atomic_t hostInterruptsOn = false;
+volatile sig_atomic_t hostInterruptsPending = false;
+
+static const uint8_t kMaxInterrupts = 8;
+
+static struct {
+  int signo;
+  isr_t isr;
+} interrupts[kMaxInterrupts];
+static volatile sig_atomic_t pending[kMaxInterrupts];
+static uint8_t interruptCount = 0;
+
+// The signals that interrupts are attached to.
+static sigset_t interruptSignals;
+
+static void handleSignal(int signo) {
+  int savedErrno = errno;
+  for (uint8_t i = 0; i < interruptCount; i++) {
+    if (interrupts[i].signo == signo) pending[i] = true;
+  }
+  hostInterruptsPending = true;
+  if (hostInterruptsOn) hostServiceInterrupts();
+  errno = savedErrno;
+}
+
+uint8_t hostAttachInterrupt(int signo, isr_t isr) {
+  if (interruptCount == 0) sigemptyset(&interruptSignals);
+
+  uint8_t irq = interruptCount++;
+  interrupts[irq].signo = signo;
+  interrupts[irq].isr = isr;
+
+  if (signo) {
+    sigaddset(&interruptSignals, signo);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSignal;
+    // A handler can be switched away from, in preemptive builds, so the
+    // signal mustn't stay blocked until it returns.  The I flag keeps
+    // handlers from nesting instead.
+    sa.sa_flags = SA_RESTART | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(signo, &sa, 0);
+  }
+  return irq;
+}
+
+void hostRaiseInterrupt(uint8_t irq) {
+  pending[irq] = true;
+  hostInterruptsPending = true;
+  if (hostInterruptsOn) hostServiceInterrupts();
+}
+
+/*
+ * Handlers run with interrupts disabled, as on the AVR.  A signal that
+ * arrives meanwhile just marks its interrupt pending, to be picked up by the
+ * next trip around the loop.
+ *
+ * In preemptive builds, every handler is followed by rescheduleFromISR().
+ * That may switch tasks from inside a signal handler; the handler returns
+ * when the interrupted task is resumed.
+ */
+void hostServiceInterrupts() {
+  while (hostInterruptsPending) {
+    hostInterruptsOn = false;
+    hostInterruptsPending = false;
+    for (uint8_t i = 0; i < interruptCount; i++) {
+      if (pending[i]) {
+        pending[i] = false;
+        interrupts[i].isr();
+      }
+    }
+    rescheduleFromISR();
+    hostInterruptsOn = true;
+  }
+}
+
+void archIdle() {
+  // Block the interrupt signals while we check for work, so that one can't
+  // slip in between the check and the wait.
+  sigset_t old;
+  sigprocmask(SIG_BLOCK, &interruptSignals, &old);
+  if (!hostInterruptsPending) sigsuspend(&old);
+  sigprocmask(SIG_SETMASK, &old, 0);
+
+  hostRestoreInterrupts(true);
+  hostDisableInterrupts();
+}
+
+
+/*
+ * Stack overflow
+ */
+
+// Somewhere safe to report an overflow from.
+static uint8_t faultStack[kMinStack];
+
+static void reportOverflow(void *task) {
+  stackOverflow((Task *) task);
+}
+
+NORETURN archStackFault(Task *t) {
+  lilos_host_call_on_stack(reportOverflow, t, faultStack + sizeof(faultStack));
+}
+
+}  // namespace lilos
@@ -0,0 +1,333 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+/*
+ * Kernel microbenchmarks.
+ *
+ * "make bench" builds this against liblilos and runs it under simavr, but it
+ * works just as well on real hardware.  Each result is printed on the USART as
+ * a line of the form
+ *
+ *  BENCH name cycles
+ *
+ * giving the average cost of one operation, in CPU cycles, net of the cost of
+ * reading the clock.  Latencies are measured from the hardware event (timer
+ * compare match) to the woken task resuming.
+ *
+ * Cycles are counted with Timer/Counter 1, which this program takes over.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+
+#include <lilos/atomic.hh>
+#include <lilos/board_debug.hh>
+#include <lilos/debug.hh>
+#include <lilos/pgmspace.hh>
+#include <lilos/task.hh>
+#include <lilos/time.hh>
+#include <lilos/usart.hh>
+
+using lilos::Task;
+using lilos::TaskList;
+using lilos::msg_t;
+
+static const lilos::priority_t kBenchPriority = 3;
+static const uint16_t kIterations = 256;
+static const uint8_t kSleepIterations = 16;
+
+
+/*
+ * Cycle counting.  Timer 1 runs at clk/1; its overflows extend it to 32 bits.
+ */
+
+static volatile uint16_t timer1Overflows = 0;
+
+ISR(TIMER1_OVF_vect) {
+  timer1Overflows++;
+}
+
+static void cyclesInit() {
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);
+  TIMSK1 = _BV(TOIE1);
+}
+
+static NEVER_INLINE uint32_t cycles() {
+  ATOMIC {
+    uint16_t lo = TCNT1;
+    uint16_t hi = timer1Overflows;
+    // Account for an overflow that happened while interrupts were disabled.
+    if ((TIFR1 & _BV(TOV1)) && lo < 0x8000) hi++;
+    return ((uint32_t) hi << 16) | lo;
+  }
+}
+
+// The cost of a back-to-back pair of cycles() calls, subtracted from results.
+static uint32_t overhead;
+
+// Returns the cycles elapsed since 'start', a previous value of cycles().
+static uint32_t since(uint32_t start) {
+  return cycles() - start - overhead;
+}
+
+
+/*
+ * Output.  This uses polled transmission so that it doesn't disturb (or get
+ * disturbed by) the scheduler.
+ */
+
+static void print(const char *s) {
+  while (*s) lilos::debugUsart.writeNow(*s++);
+}
+
+static void print_P(const prog_char *s) {
+  char c;
+  while ((c = pgm_read_byte(s++))) lilos::debugUsart.writeNow(c);
+}
+
+static void report(const prog_char *name, uint32_t total, uint16_t count) {
+  char buf[11];
+  print_P(PSTR("BENCH "));
+  print_P(name);
+  print_P(PSTR(" "));
+  print(ultoa(total / count, buf, 10));
+  print_P(PSTR("\n"));
+}
+
+
+/*
+ * yield(): a partner task at the same priority yields back and forth with the
+ * benchmark task.
+ */
+
+static volatile bool partnerSpinning = false;
+static TaskList parked;
+
+TASK(yieldPartner, kMinStack, kBenchPriority) {
+  while (1) {
+    if (partnerSpinning) {
+      lilos::yield();
+    } else {
+      lilos::sendVoid(&parked);
+    }
+  }
+}
+
+static void benchYield() {
+  // With nobody else at our priority, yield() returns straight away.
+  uint32_t start = cycles();
+  for (uint16_t i = 0; i < kIterations; i++) lilos::yield();
+  report(PSTR("yield_alone"), since(start), kIterations);
+
+  partnerSpinning = true;
+  lilos::answerVoid(parked.head());
+  lilos::yield();  // Let it get going.
+
+  // Each iteration is two switches: to the partner and back.
+  start = cycles();
+  for (uint16_t i = 0; i < kIterations; i++) lilos::yield();
+  report(PSTR("yield_switch"), since(start), kIterations * 2);
+
+  partnerSpinning = false;
+  lilos::yield();  // Let it park.
+}
+
+
+/*
+ * send()/answer() round trips, against servers written both ways.
+ */
+
+TASK(answerServer, kMinStack, kBenchPriority) {
+  while (1) {
+    Task *sender = lilos::receive();
+    lilos::answer(sender, sender->message() + 1);
+  }
+}
+
+TASK(replyServer, kMinStack, kBenchPriority) {
+  Task *sender = lilos::receive();
+  while (1) {
+    sender = lilos::replyAndReceive(sender, sender->message() + 1);
+  }
+}
+
+static void benchSend() {
+  uint32_t start = cycles();
+  for (uint16_t i = 0; i < kIterations; i++) lilos::send(&answerServer, i);
+  report(PSTR("send_answer"), since(start), kIterations);
+
+  start = cycles();
+  for (uint16_t i = 0; i < kIterations; i++) lilos::send(&replyServer, i);
+  report(PSTR("send_reply_receive"), since(start), kIterations);
+}
+
+
+/*
+ * receive() with a sender already waiting.
+ */
+
+TASK(client, kMinStack, kBenchPriority) {
+  while (1) {
+    lilos::sendVoid(&parked);
+    lilos::send(lilos::currentTask()->message<Task *>(), 0);
+  }
+}
+
+static void benchReceive() {
+  client.setMessage(lilos::currentTask());
+  lilos::answerVoid(parked.head());
+  lilos::yield();  // Client sends to us.
+
+  Task *sender = 0;
+  uint32_t start = cycles();
+  for (uint16_t i = 0; i < kIterations; i++) sender = lilos::receive();
+  report(PSTR("receive_pending"), since(start), kIterations);
+
+  lilos::answerVoid(sender);
+  lilos::yield();  // Client parks.
+}
+
+
+/*
+ * sleepUntil(): latency from the timer compare match to the task resuming.
+ *
+ * Timer 2 (owned by the time module) counts at clk/256.  We find the phase of
+ * its ticks relative to Timer 1 once, so that when we wake we can work out, to
+ * within a few cycles, when the compare match happened.
+ */
+
+static uint8_t timer2Phase;
+
+static void findTimer2Phase() {
+  ATOMIC {
+    uint8_t count = TCNT2;
+    while (TCNT2 == count);
+    timer2Phase = (uint8_t) cycles();
+  }
+}
+
+static uint32_t cyclesSinceTimer2Match() {
+  ATOMIC {
+    uint8_t count, match;
+    uint32_t now;
+    do {
+      count = TCNT2;
+      now = cycles();
+    } while (TCNT2 != count);
+    match = OCR2A;
+
+    uint32_t tick = now - (uint8_t) (now - timer2Phase);
+    return now - (tick - (uint32_t) (uint8_t) (count - match) * 256);
+  }
+}
+
+/*
+ * Waits for Timer 2 to overflow, and returns a deadline two milliseconds on.
+ * That's well inside the overflow period just begun, so sleepUntil() arms
+ * compare match A for it.  A deadline that happened to fall in the last count
+ * before an overflow would be left to the overflow interrupt instead, leaving
+ * OCR2A stale and the sample meaningless.
+ */
+static uint32_t compareMatchDeadline() {
+  uint8_t count = TCNT2;
+  uint8_t last;
+  do {
+    last = count;
+    count = TCNT2;
+  } while (count >= last);
+  return lilos::ticks() + 2;
+}
+
+static void benchSleep() {
+  findTimer2Phase();
+
+  // A deadline that has already passed.
+  uint32_t start = cycles();
+  for (uint16_t i = 0; i < kIterations; i++) lilos::sleepUntil(0);
+  report(PSTR("sleep_expired"), since(start), kIterations);
+
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < kSleepIterations; i++) {
+    lilos::sleepUntil(compareMatchDeadline());
+    total += cyclesSinceTimer2Match();
+  }
+  report(PSTR("sleep_wakeup"), total, kSleepIterations);
+}
+
+
+/*
+ * ISR-to-task wakeup: Timer 1's compare match B interrupt answers a task
+ * blocked on a TaskList, as a driver's ISR would.
+ */
+
+static TaskList isrWaiters;
+
+ISR(TIMER1_COMPB_vect) {
+  TIMSK1 &= ~_BV(OCIE1B);
+  Task *t = isrWaiters.headNonAtomic();
+  if (t) lilos::answerVoid(t);
+  lilos::rescheduleFromISR();
+}
+
+static void benchIsrWakeup() {
+  uint32_t total = 0;
+  for (uint16_t i = 0; i < kIterations; i++) {
+    ATOMIC {
+      OCR1B = TCNT1 + 200;
+      TIFR1 = _BV(OCF1B);
+      TIMSK1 |= _BV(OCIE1B);
+      lilos::sendVoid(&isrWaiters);
+      total += (uint16_t) (TCNT1 - OCR1B);
+    }
+  }
+  report(PSTR("isr_wakeup"), total, kIterations);
+}
+
+
+TASK(benchTask, kMinStack + 64, kBenchPriority) {
+  uint32_t a = cycles();
+  uint32_t b = cycles();
+  overhead = b - a;
+  report(PSTR("cycles_overhead"), overhead, 1);
+
+  // Let the other tasks run until they block, waiting for us.
+  lilos::yield();
+
+  benchYield();
+  benchSend();
+  benchReceive();
+  benchSleep();
+  benchIsrWakeup();
+
+  // Wait for the last byte to leave, then stop.  (simavr exits when the CPU
+  // sleeps with interrupts disabled.)
+  UCSR0A |= _BV(TXC0);
+  print_P(PSTR("BENCH done 0\n"));
+  while (!(UCSR0A & _BV(TXC0)));
+  cli();
+  sleep_enable();
+  while (1) sleep_cpu();
+}
+
+NORETURN main() {
+  lilos::timeInit();
+  lilos::debugInit();
+  cyclesInit();
+  sei();
+
+  schedule(&benchTask);
+  schedule(&yieldPartner);
+  schedule(&answerServer);
+  schedule(&replyServer);
+  schedule(&client);
+
+  lilos::startTasking();
+}
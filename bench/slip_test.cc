@@ -0,0 +1,206 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+/*
+ * A test of SlipLink for the host build ("make BOARD=host slip-test").
+ *
+ * The host USART's output is looped back into its input through a pipe, so
+ * frames the link sends come back to it, and the test can put arbitrary bytes
+ * on the wire by writing to the pipe itself.  It checks the CRC and escaping
+ * against its own encoder, the handling of bad frames, and the handoff between
+ * the two receive buffers.  Results go to stderr; the exit status is 1 if
+ * anything went wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <avr/interrupt.h>
+
+#include <lilos/slip.hh>
+#include <lilos/task.hh>
+#include <lilos/time.hh>
+#include <lilos/usart.hh>
+#include <lilos/mcu_usart.hh>
+
+using lilos::usart0;
+
+static const uint8_t kEnd = 0xC0;
+static const uint8_t kEsc = 0xDB;
+
+static lilos::SlipLink<16> packets(&usart0);
+static uint32_t failures = 0;
+
+static void check(bool ok, const char *what) {
+  if (ok) return;
+  fprintf(stderr, "FAIL: %s\n", what);
+  failures++;
+}
+
+// CRC-16-CCITT, bit by bit, independently of the kernel's.
+static uint16_t crc16(const uint8_t *data, size_t n) {
+  uint16_t crc = 0xFFFF;
+  while (n--) {
+    crc ^= (uint16_t) *data++ << 8;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static uint8_t *escape(uint8_t *out, uint8_t b) {
+  if (b == kEnd) {
+    *out++ = kEsc;
+    *out++ = 0xDC;
+  } else if (b == kEsc) {
+    *out++ = kEsc;
+    *out++ = 0xDD;
+  } else {
+    *out++ = b;
+  }
+  return out;
+}
+
+// Encodes a frame as it should appear on the wire.  Returns its length.
+static size_t encode(const uint8_t *data, size_t n, uint8_t *out) {
+  uint8_t *p = out;
+  uint16_t crc = crc16(data, n);
+  *p++ = kEnd;
+  for (size_t i = 0; i < n; i++) p = escape(p, data[i]);
+  p = escape(p, crc >> 8);
+  p = escape(p, crc);
+  *p++ = kEnd;
+  return p - out;
+}
+
+// Puts bytes on the wire, and gives the receive interrupt time to take them.
+static void inject(const uint8_t *bytes, size_t n) {
+  if (write(1, bytes, n) != (ssize_t) n) check(false, "write to the pipe");
+  lilos::sleepUntil(lilos::ticks() + 20);
+}
+
+static void injectFrame(const uint8_t *data, size_t n) {
+  uint8_t wire[64];
+  inject(wire, encode(data, n, wire));
+}
+
+static bool receives(const uint8_t *data, size_t n) {
+  const uint8_t *frame;
+  size_t length = packets.receive(&frame);
+  return length == n && !memcmp(frame, data, n);
+}
+
+static const uint8_t kCheckInput[] = "123456789";
+static const uint8_t kSpecial[] = { 0x01, kEnd, kEsc, 0x02 };
+static const uint8_t kA[] = { 'A', 'a' };
+static const uint8_t kB[] = { 'B', 'b', 'b' };
+static const uint8_t kC[] = { 'C' };
+static const uint8_t kD[] = { 'D', kEnd, 'd' };
+
+static void testCrc() {
+  check(crc16(kCheckInput, 9) == 0x29B1, "test's CRC of \"123456789\"");
+
+  // The standard check value, on the wire by hand.
+  const uint8_t wire[] = {
+    kEnd, '1', '2', '3', '4', '5', '6', '7', '8', '9', 0x29, 0xB1, kEnd,
+  };
+  inject(wire, sizeof(wire));
+  check(receives(kCheckInput, 9), "frame with the check value");
+}
+
+static void testEncoding() {
+  // With the link detached, the frame can be read back raw.
+  packets.detach();
+  packets.send(kSpecial, sizeof(kSpecial));
+  uint8_t expected[32], actual[32];
+  size_t n = encode(kSpecial, sizeof(kSpecial), expected);
+  size_t got = usart0.read(actual, n, 20);
+  check(got == n && !memcmp(actual, expected, n), "escaped frame on the wire");
+  packets.attach();
+
+  injectFrame(kSpecial, sizeof(kSpecial));
+  check(receives(kSpecial, sizeof(kSpecial)), "escaped frame decoded");
+
+  packets.send(kSpecial, sizeof(kSpecial));
+  check(receives(kSpecial, sizeof(kSpecial)), "frame sent and looped back");
+  check(packets.crcErrors() == 0, "no CRC errors on good frames");
+}
+
+static void testBadFrames() {
+  uint8_t wire[32];
+  size_t n = encode(kA, sizeof(kA), wire);
+  wire[n - 2] ^= 1;
+  inject(wire, n);
+  check(packets.crcErrors() == 1, "bad CRC counted");
+
+  const uint8_t garbled[] = { kEnd, 'x', kEsc, 'y', 'z', 0, 0, kEnd };
+  inject(garbled, sizeof(garbled));
+  check(packets.crcErrors() == 2, "bad escape counted");
+
+  // Neither is delivered.
+  injectFrame(kA, sizeof(kA));
+  check(receives(kA, sizeof(kA)), "good frame after bad ones");
+}
+
+static void testHandoff() {
+  injectFrame(kA, sizeof(kA));
+  const uint8_t *a;
+  size_t length = packets.receive(&a);
+  check(length == sizeof(kA) && !memcmp(a, kA, length), "first frame");
+
+  // While A is held, B waits in the other buffer, and C has nowhere to go.
+  injectFrame(kB, sizeof(kB));
+  injectFrame(kC, sizeof(kC));
+  check(!memcmp(a, kA, sizeof(kA)), "held frame left alone");
+  check(packets.dropped() == 1, "third frame dropped");
+
+  check(receives(kB, sizeof(kB)), "frame received while another was held");
+
+  // With B held, D waits in the fill buffer until B is released.
+  injectFrame(kD, sizeof(kD));
+  check(receives(kD, sizeof(kD)), "frame completed while both were in use");
+  check(packets.dropped() == 1, "nothing else dropped");
+  check(packets.crcErrors() == 2, "no new CRC errors");
+}
+
+TASK(testTask, kMinStack) {
+  packets.attach();
+  testCrc();
+  testEncoding();
+  testBadFrames();
+  testHandoff();
+
+  fprintf(stderr, "slip: %lu failures\n", (unsigned long) failures);
+  exit(failures ? 1 : 0);
+}
+
+// A lost frame would leave the test blocked in receive().
+TASK(watchdogTask, kMinStack, 3) {
+  lilos::sleepUntil(lilos::ticks() + 5000);
+  fprintf(stderr, "FAIL: timed out\n");
+  exit(1);
+}
+
+int main() {
+  // Loop the USART back on itself.
+  int fds[2];
+  if (pipe(fds) || dup2(fds[0], 0) < 0 || dup2(fds[1], 1) < 0) {
+    perror("pipe");
+    return 1;
+  }
+
+  lilos::timeInit();
+  usart0.initialize(115200, lilos::USART::DATA_8, lilos::USART::PARITY_NONE,
+                    lilos::USART::STOP_1);
+  sei();
+
+  schedule(&testTask);
+  schedule(&watchdogTask);
+  lilos::startTasking();
+}
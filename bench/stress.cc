@@ -0,0 +1,107 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+/*
+ * A load test for the host build ("make BOARD=host stress").
+ *
+ * Thousands of client tasks hammer a server with messages, checking every
+ * reply, while a thousand more sleep on staggered deadlines, checking that
+ * they never wake early.  Once a second a high-priority task prints the
+ * message and wakeup rates; after a few seconds it exits, with status 1 if
+ * anything went wrong.
+ *
+ * With time slicing, one more task spins without ever blocking, and the
+ * clients sharing its priority must still make progress.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avr/interrupt.h>
+
+#include <lilos/task.hh>
+#include <lilos/time.hh>
+
+using lilos::Task;
+using lilos::msg_t;
+
+static const uint16_t kClients = 2000;
+static const uint16_t kSleepers = 1000;
+static const uint8_t kSeconds = 5;
+
+static uint32_t messages = 0;
+static uint32_t wakeups = 0;
+static uint32_t failures = 0;
+
+TASK(serverTask, kMinStack, 2) {
+  Task *client = lilos::receive();
+  while (1) {
+    messages++;
+    client = lilos::replyAndReceive(client, client->message() + 1);
+  }
+}
+
+#ifdef LILOS_TIMESLICE
+TASK(spinTask, kMinStack) {
+  while (1);
+}
+#endif
+
+static NORETURN clientMain() {
+  msg_t n = (msg_t) lilos::currentTask();
+  while (1) {
+    msg_t reply = lilos::send(&serverTask, n);
+    if (reply != n + 1) failures++;
+    n = reply;
+  }
+}
+
+static NORETURN sleeperMain() {
+  uint32_t period = 1 + (uintptr_t) lilos::currentTask() % 50;
+  while (1) {
+    uint32_t deadline = lilos::ticks() + period;
+    lilos::sleepUntil(deadline);
+    if ((int32_t) (lilos::ticks() - deadline) < 0) failures++;
+    wakeups++;
+  }
+}
+
+TASK(reportTask, kMinStack, 3) {
+  lilos::IntervalTimer timer(1000);
+  for (uint8_t s = 1; s <= kSeconds; s++) {
+    timer.wait();
+    printf("%us: %lu messages/s, %lu wakeups/s, %lu failures\n", s,
+           (unsigned long) messages, (unsigned long) wakeups,
+           (unsigned long) failures);
+    fflush(stdout);
+    if (!messages || !wakeups) failures++;
+    messages = 0;
+    wakeups = 0;
+  }
+  exit(failures ? 1 : 0);
+}
+
+static void spawn(lilos::main_t entry, uint16_t count) {
+  while (count--) {
+    Task *t = new Task(entry, (uint8_t *) malloc(kMinStack), kMinStack);
+    schedule(t);
+  }
+}
+
+int main() {
+  lilos::timeInit();
+  sei();
+
+  spawn(clientMain, kClients);
+  spawn(sleeperMain, kSleepers);
+  schedule(&serverTask);
+  schedule(&reportTask);
+#ifdef LILOS_TIMESLICE
+  schedule(&spinTask);
+#endif
+
+  lilos::startTasking();
+}
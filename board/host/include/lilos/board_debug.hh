@@ -0,0 +1,20 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_BOARD_DEBUG_HH_
+#define LILOS_BOARD_DEBUG_HH_
+
+namespace lilos {
+
+template <uint8_t N> class USARTPort;
+extern USARTPort<0> usart0;
+
+static USARTPort<0> &debugUsart = usart0;
+static const uint32_t kDebugBaudrate = 38400;  // Ignored on the host.
+
+};
+
+#endif  // LILOS_BOARD_DEBUG_HH_
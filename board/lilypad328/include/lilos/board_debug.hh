@@ -9,10 +9,10 @@
 
 namespace lilos {
 
-class USART;
-extern USART usart0;
+template <uint8_t N> class USARTPort;
+extern USARTPort<0> usart0;
 
-static USART &debugUsart = usart0;
+static USARTPort<0> &debugUsart = usart0;
 static const uint32_t kDebugBaudrate = 38400;
 
 };
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_ARCH_HH_
+#define LILOS_ARCH_HH_
+
+/*
+ * The interface between the portable kernel (src/task.cc) and the code that
+ * depends on the CPU: how contexts are laid out, saved and restored, how the
+ * processor idles, and so on.  Each architecture implements it in
+ * arch/$(ARCH).  (Peripherals, such as timers and USARTs, are the business of
+ * mcu/$(MMCU) instead.)
+ *
+ * This is kernel plumbing, not for use by applications.
+ */
+
+#include <lilos/task.hh>
+
+namespace lilos {
+
+/*
+ * Provided by the kernel, for use by the architecture code.
+ */
+
+// The currently executing task.
+extern Task * volatile _currentTask;
+
+
+/*
+ * Provided by the architecture.
+ */
+
+/*
+ * Builds the context of a task that has yet to run, so that resuming it calls
+ * entry with interrupts enabled.  Returns the saved stack pointer.
+ */
+stack_t archInitialContext(main_t entry, uint8_t *stack, size_t stackSize);
+
+/*
+ * Saves the current task's context, makes next the current task, and resumes
+ * it.  May be called with interrupts enabled or not; they're disabled for the
+ * switch itself, and the caller's interrupt state comes back when it's next
+ * resumed.  Pushes no more than kArchSwitchFrame bytes on the current task's
+ * stack, call included.
+ */
+void yieldTo(Task *next);
+
+// Resumes the first task, abandoning the context that main() ran in.
+NORETURN archStartTasking(Task *first);
+
+/*
+ * Puts the processor to sleep until an interrupt arrives, and services it.
+ * Called, and returns, with interrupts disabled.
+ */
+void archIdle();
+
+/*
+ * Gets off a task's stack, which can no longer be trusted, and calls
+ * stackOverflow().
+ */
+NORETURN archStackFault(Task *);
+
+// The address at which a task that isn't running will resume, for dumps.
+uintptr_t archSavedPC(Task *);
+
+}  // namespace lilos
+
+#endif  // LILOS_ARCH_HH_
@@ -25,6 +25,15 @@
  *    do_work();
  *  }
  */
+#ifdef LILOS_LATENCY
+// Times each block that disables interrupts; see <lilos/latency.hh>.
+#include <lilos/latency.hh>
+#define ATOMIC ATOMIC_BLOCK(ATOMIC_RESTORESTATE) \
+  for (lilos::LatencyProbe __latencyProbe(LILOS_LATENCY_SITE(), \
+           lilos::archInterruptsWereEnabled(sreg_save)); \
+       __latencyProbe.once(); )
+#else
 #define ATOMIC ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#endif
 
 #endif  // LILOS_ATOMIC_HH_
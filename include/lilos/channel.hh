@@ -0,0 +1,146 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_CHANNEL_HH_
+#define LILOS_CHANNEL_HH_
+
+/*
+ * Typed, buffered producer/consumer channels.
+ *
+ * A Channel<T, N> holds up to N values of type T, copied in and out, so that
+ * tasks can stream values larger than a msg_t without passing pointers and
+ * without a rendezvous at each value.  Producers block only while the channel
+ * is full, and consumers only while it is empty.  The batch operations, putN
+ * and getN, move as many values as they can each time they're woken.
+ *
+ * T is copied byte-for-byte, so it should be a plain struct or integer type,
+ * of at most 255 bytes.  The copies are made with interrupts disabled -- a
+ * batch operation copies everything that fits in one go -- so large elements
+ * and large batches add directly to interrupt latency.
+ *
+ * Example:
+ *
+ *  struct Sample { uint16_t x, y, z; };
+ *  Channel<Sample, 8> samples;
+ *
+ *  TASK(sensor, kMinStack + 16) {
+ *    while (1) samples.put(readSensor());
+ *  }
+ *
+ *  TASK(filter, kMinStack + 32) {
+ *    Sample batch[4];
+ *    while (1) {
+ *      samples.getN(batch, 4);
+ *      process(batch, 4);
+ *    }
+ *  }
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lilos/static_assert.hh>
+#include <lilos/task.hh>
+
+namespace lilos {
+
+/*
+ * The type-independent parts of Channel, which deal in elements of a fixed
+ * number of bytes.  Sharing this between all Channels keeps each new element
+ * type from costing a copy of the blocking logic.
+ */
+class ChannelBase {
+  // Ring buffer: _count elements, the oldest at index _head.
+  uint8_t *_buffer;
+  uint8_t _elementSize;
+  uint8_t _capacity;
+  volatile uint8_t _head;
+  volatile uint8_t _count;
+
+  // Tasks blocked putting into a full channel.
+  TaskList _putters;
+  // Tasks blocked getting from an empty channel.
+  TaskList _getters;
+
+public:
+  // Returns the number of buffered elements.
+  uint8_t count() { return _count; }
+
+protected:
+  ChannelBase(uint8_t *buffer, uint8_t elementSize, uint8_t capacity);
+
+  /*
+   * Copies up to n elements in (or out) without blocking.  Returns the number
+   * actually copied.  Safe for use in ISRs.
+   */
+  size_t tryPutBytes(const uint8_t *src, size_t n);
+  size_t tryGetBytes(uint8_t *dst, size_t n);
+
+  // Copies exactly n elements in (or out), blocking as needed.
+  void putBytes(const uint8_t *src, size_t n);
+  void getBytes(uint8_t *dst, size_t n);
+
+private:
+  size_t putNonAtomic(const uint8_t *src, size_t n);
+  size_t getNonAtomic(uint8_t *dst, size_t n);
+};
+
+template <typename T, uint8_t N>
+class Channel : public ChannelBase {
+  T _storage[N];
+
+public:
+  Channel()
+    : ChannelBase(reinterpret_cast<uint8_t *>(_storage), sizeof(T), N) {
+    static_assert(ElementTooLarge, sizeof(T) <= 255);
+  }
+
+  // Adds a value, blocking while the channel is full.
+  void put(const T &value) {
+    putBytes(reinterpret_cast<const uint8_t *>(&value), 1);
+  }
+
+  // Removes the oldest value, blocking while the channel is empty.
+  T get() {
+    T value;
+    getBytes(reinterpret_cast<uint8_t *>(&value), 1);
+    return value;
+  }
+
+  // Adds a value if there's room.  Returns false if the channel is full.
+  bool tryPut(const T &value) {
+    return tryPutBytes(reinterpret_cast<const uint8_t *>(&value), 1);
+  }
+
+  // Removes the oldest value, if any.  Returns false if the channel is empty.
+  bool tryGet(T *value) {
+    return tryGetBytes(reinterpret_cast<uint8_t *>(value), 1);
+  }
+
+  // Adds n values, blocking as needed until all have been added.
+  void putN(const T *values, size_t n) {
+    putBytes(reinterpret_cast<const uint8_t *>(values), n);
+  }
+
+  // Removes n values, blocking as needed until all have been removed.
+  void getN(T *values, size_t n) {
+    getBytes(reinterpret_cast<uint8_t *>(values), n);
+  }
+
+  // Adds as many of n values as will fit.  Returns the number added.
+  size_t tryPutN(const T *values, size_t n) {
+    return tryPutBytes(reinterpret_cast<const uint8_t *>(values), n);
+  }
+
+  // Removes up to n values, without blocking.  Returns the number removed.
+  size_t tryGetN(T *values, size_t n) {
+    return tryGetBytes(reinterpret_cast<uint8_t *>(values), n);
+  }
+};
+
+}  // namespace lilos
+
+#endif  // LILOS_CHANNEL_HH_
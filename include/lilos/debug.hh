@@ -36,9 +36,20 @@ void debugWrite_P(const prog_char *);
 // Writes out a hexadecimal integer.
 void debugWrite(uint32_t);
 
+// Writes out a decimal integer.
+void debugWriteDec(uint32_t);
+
 // Ends the line.
 void debugLn();
 
+/*
+ * Switches the debug system into polled mode, where output is sent directly
+ * to the hardware without using interrupts or blocking.  This is for use when
+ * the scheduler can no longer be trusted, such as from a fault handler like
+ * stackOverflow().  There is no way back to normal mode.
+ */
+void debugPanic();
+
 }  // namespace lilos
 
 #endif  // LILOS_DEBUG_HH_
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_LATENCY_HH_
+#define LILOS_LATENCY_HH_
+
+/*
+ * Interrupt latency instrumentation
+ *
+ * Building with LILOS_LATENCY defined (make LATENCY=1) times every stretch of
+ * code that runs with interrupts disabled, using a free hardware timer (Timer
+ * 1 on the AVR):
+ *
+ *  - each ATOMIC block that actually disables interrupts (rather than nesting
+ *    inside another), recorded against its file and line;
+ *  - each context switch, from just before the outgoing task's context is
+ *    saved until the incoming one's is restored;
+ *  - on the AVR, how late a sampling interrupt runs, every few milliseconds:
+ *    the latency an ISR actually sees.
+ *
+ * For each, the kernel keeps the longest time seen and a histogram.  Call
+ * latencyDump() to write them out with the debug API, which tells you which
+ * code path is holding interrupts off the longest.
+ *
+ * Times are in ticks of kLatencyCyclesPerTick CPU cycles, and wrap after
+ * 65535 ticks.  Recording takes a few dozen cycles, inside the critical
+ * section being timed, so expect short sections to look a little longer than
+ * they are.
+ *
+ * Each ATOMIC call site in the program has its own LatencySite, 26 bytes of
+ * RAM reserved from reset whether or not it's ever reached.  The kernel alone
+ * has nearly fifty, well over a kilobyte, so this is for development builds.
+ * The sites are zeroed at startup rather than copied from flash, and fill in
+ * their file and line the first time they're reached; the file name is
+ * stored once per source file.
+ *
+ * Code that disables interrupts with a bare cli() isn't timed.
+ */
+
+#include <stdint.h>
+
+#include <lilos/pgmspace.hh>
+#include <lilos/util.hh>
+#include <lilos/arch_config.hh>
+
+namespace lilos {
+
+static const uint8_t kLatencyCyclesPerTick = 8;
+
+/*
+ * Histogram bucket N counts times below 2^(N+1) ticks; the last bucket counts
+ * everything longer.
+ */
+static const uint8_t kLatencyBuckets = 8;
+
+// Everything recorded about one place where interrupts are disabled.
+struct LatencySite {
+  const prog_char *file;  // or a description, if line is zero
+  uint16_t line;
+  bool listed;
+  LatencySite *next;
+  uint16_t max;
+  uint16_t histogram[kLatencyBuckets];
+};
+
+// Starts the timer.  Call before sei() in main().
+void latencyInit();
+
+// Writes out every site reached so far, using the debug API.
+void latencyDump();
+
+// Forgets everything recorded so far, e.g. after startup.
+void latencyReset();
+
+// Records a time against a site.  Interrupts must be disabled.
+void latencyRecord(LatencySite *, uint16_t ticks);
+
+
+/*
+ * Provided by the MCU.
+ */
+
+// Sets up a free-running timer, counting once every kLatencyCyclesPerTick.
+void latencyTimerInit();
+
+// Reads the timer.
+uint16_t latencyNow();
+
+
+/*
+ * Used by ATOMIC and the kernel.
+ */
+
+// Whether a stretch with interrupts disabled is being timed, and since when.
+extern bool latencyOpen;
+extern uint16_t latencyOffSince;
+
+/*
+ * Times one ATOMIC block.  Constructed just after interrupts are disabled,
+ * and destroyed just before they're restored.
+ */
+class LatencyProbe {
+  LatencySite *_site;
+  bool _once;
+
+public:
+  LatencyProbe(LatencySite *site, bool wasEnabled)
+    : _site(wasEnabled ? site : 0), _once(true) {
+    if (_site) {
+      latencyOffSince = latencyNow();
+      latencyOpen = true;
+    }
+  }
+
+  ~LatencyProbe() {
+    // If we switched tasks in here, the switch was timed on its own.
+    if (_site && latencyOpen) {
+      latencyRecord(_site, latencyNow() - latencyOffSince);
+      latencyOpen = false;
+    }
+  }
+
+  // True the first time it's called, to let ATOMIC loop once.
+  bool once() {
+    bool o = _once;
+    _once = false;
+    return o;
+  }
+};
+
+/*
+ * The kernel calls these around each context switch, with interrupts
+ * disabled.  The state returned by latencySwitchOut() belongs to the
+ * outgoing task, and is handed back to latencySwitchIn() when it's resumed.
+ */
+bool latencySwitchOut();
+void latencySwitchIn(bool open);
+
+}  // namespace lilos
+
+/*
+ * The name of the source file, shared by all of its sites.  This names the
+ * file being compiled, not a header, which is fine as long as headers don't
+ * use ATOMIC.
+ */
+static const prog_char __latencyFile[] PROGMEM = __BASE_FILE__;
+
+/*
+ * The LatencySite for the current file and line: one per expansion.  Used
+ * with interrupts disabled, so filling it in can't race.
+ */
+#define LILOS_LATENCY_SITE() (__extension__({ \
+  static lilos::LatencySite __latencySite; \
+  if (!__latencySite.file) { \
+    __latencySite.file = __latencyFile; \
+    __latencySite.line = __LINE__; \
+  } \
+  &__latencySite; \
+}))
+
+#endif  // LILOS_LATENCY_HH_
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_MAILBOX_HH_
+#define LILOS_MAILBOX_HH_
+
+/*
+ * Asynchronous messaging.
+ *
+ * send() is a rendezvous: the sender waits until the receiver answers.  A
+ * Mailbox instead buffers a fixed number of messages, so a producer can post a
+ * message and carry on without waiting for the consumer to get around to it.
+ * Producers block only while the mailbox is full, and consumers only while it
+ * is empty.
+ *
+ * Example:
+ *
+ *  MAILBOX(logQueue, 8);
+ *
+ *  TASK(logger, kMinStack) {
+ *    while (1) {
+ *      record(logQueue.receive());
+ *    }
+ *  }
+ *
+ *  void log(msg_t event) {
+ *    logQueue.post(event);
+ *  }
+ */
+
+#include <stdint.h>
+
+#include <lilos/task.hh>
+
+namespace lilos {
+
+class Mailbox {
+  // Ring buffer of messages: _count messages, the oldest at _buffer[_head].
+  msg_t *_buffer;
+  uint8_t _capacity;
+  volatile uint8_t _head;
+  volatile uint8_t _count;
+
+  /*
+   * Tasks blocked in post() because the mailbox is full.  Each one's message
+   * slot holds the message it's trying to post.
+   */
+  TaskList _senders;
+
+  // Tasks blocked in receive() because the mailbox is empty.
+  TaskList _receivers;
+
+public:
+  /*
+   * Creates an empty Mailbox using the given storage, which holds 'capacity'
+   * messages (at least one).  The MAILBOX macro (below) does this for you.
+   */
+  Mailbox(msg_t *buffer, uint8_t capacity);
+
+  /*
+   * Adds a message to the mailbox.  If the mailbox is full, blocks until
+   * there's room.  Must not be used from ISRs.
+   */
+  void post(msg_t);
+
+  /*
+   * Adds a message to the mailbox if there's room, without blocking.  Returns
+   * false (and drops the message) if the mailbox is full.  Safe for use in
+   * ISRs.
+   */
+  bool trySend(msg_t);
+
+  /*
+   * Removes and returns the oldest message.  If the mailbox is empty, blocks
+   * until a message arrives.  Must not be used from ISRs.
+   */
+  msg_t receive();
+
+  /*
+   * Removes the oldest message and stores it at the given address, without
+   * blocking.  Returns false if the mailbox was empty.  Safe for use in ISRs.
+   */
+  bool tryReceive(msg_t *);
+
+  // Returns the number of buffered messages.
+  uint8_t count() { return _count; }
+
+private:
+  bool putNonAtomic(msg_t);
+  msg_t takeNonAtomic();
+};
+
+}  // namespace lilos
+
+/*
+ * Declares a Mailbox and its storage in one go:
+ *
+ *  MAILBOX(myMailbox, 4);
+ */
+#define MAILBOX(name, capacity) \
+  lilos::msg_t name ## Buffer[capacity]; \
+  lilos::Mailbox name(name ## Buffer, capacity)
+
+#endif  // LILOS_MAILBOX_HH_
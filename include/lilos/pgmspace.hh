@@ -13,7 +13,7 @@
 
 #include <avr/pgmspace.h>
 
-#ifdef __cplusplus
+#if defined(__cplusplus) && defined(__AVR__)
 /*
  * Workarounds for an avr-g++ bug that causes spurious warnings.
  */
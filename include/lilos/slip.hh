@@ -0,0 +1,137 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_SLIP_HH_
+#define LILOS_SLIP_HH_
+
+/*
+ * Checksummed packets over a USART, framed with SLIP (RFC 1055).
+ *
+ * A SlipLink<N> carries frames of up to N bytes.  All the per-byte work is
+ * done by the USART's interrupt handlers: received bytes are unescaped and
+ * checksummed as they arrive, and a task waiting in receive() is only woken
+ * once a whole frame has arrived and passed its check.  Frames that fail are
+ * dropped without waking anyone.  Sent frames are escaped and checksummed on
+ * the fly, straight from the sender's buffer.
+ *
+ * On the wire, each frame is END, the payload, its CRC-16-CCITT (polynomial
+ * 0x1021, initial value 0xFFFF, most significant byte first), and END, with
+ * any END or ESC bytes in the payload or CRC escaped.
+ *
+ * Once attached, the link takes all of the USART's input; read() only returns
+ * what was buffered before.  Writes still work, and never land in the middle
+ * of a frame.
+ *
+ * The link has two frame buffers: while the task works on one frame, the
+ * interrupt receives the next into the other, where it waits for receive().
+ * Frames that arrive while both buffers are full are dropped, until the task
+ * calls receive() again and frees one.  Only one task should receive.
+ *
+ * Example:
+ *
+ *  SlipLink<64> packets(&usart0);
+ *
+ *  TASK(server, kMinStack + 16) {
+ *    packets.attach();
+ *    while (1) {
+ *      const uint8_t *frame;
+ *      size_t length = packets.receive(&frame);
+ *      packets.send(frame, length);  // echo
+ *    }
+ *  }
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lilos/task.hh>
+#include <lilos/usart.hh>
+
+namespace lilos {
+
+/*
+ * The size-independent parts of SlipLink.
+ */
+class SlipLinkBase {
+  USART *_usart;
+  uint8_t *_buffers[2];
+  size_t _capacity;  // of each buffer, including the CRC
+
+  // Receive state.  The interrupt fills _buffers[_fill]; the other buffer is
+  // free, holds a frame nobody has asked for yet, or is held by the task.  If
+  // a frame is completed while the other buffer is in use, it waits in
+  // _buffers[_fill] (pending), and input is dropped until they can swap.
+  uint8_t _fill;
+  uint8_t _other;
+  bool _pending;
+  size_t _length;
+  size_t _otherLength;
+  size_t _pendingLength;
+  uint16_t _crc;
+  bool _escape;
+  uint8_t _discard;  // nonzero if the frame is bad; see slip.cc
+
+  // The task blocked in receive(), if any.
+  TaskList _receivers;
+
+  volatile uint16_t _crcErrors;
+  volatile uint16_t _dropped;
+
+public:
+  // Starts taking the USART's input.
+  void attach();
+
+  // Returns the USART's input to read().
+  void detach();
+
+  /*
+   * Waits for a valid frame, returning its length and pointing *frame at
+   * it.  The frame stays valid until the next call.
+   */
+  size_t receive(const uint8_t **frame);
+
+  /*
+   * Sends a frame, blocking until it's gone.  The frame is read directly
+   * from data, so it mustn't change meanwhile.
+   */
+  void send(const uint8_t *data, size_t length);
+
+  /*
+   * Count frames lost since the link was constructed: those that failed
+   * their CRC or were garbled, and those that were too long or arrived with
+   * no buffer free.  Both saturate at 65535.
+   */
+  uint16_t crcErrors();
+  uint16_t dropped();
+
+protected:
+  SlipLinkBase(USART *, uint8_t *buffer0, uint8_t *buffer1, size_t capacity);
+
+private:
+  struct TxFrame;
+  static bool encode(USART::TxBlock *, uint8_t *);
+
+  void receiveFromISR(uint8_t data, bool lostBefore);
+  void endFrame();
+  void deliver(size_t length);
+  void restart();
+
+  friend class USART;
+};
+
+template <size_t N>
+class SlipLink : public SlipLinkBase {
+  // Each with room for the CRC.
+  uint8_t _storage[2][N + 2];
+
+public:
+  SlipLink(USART *usart)
+    : SlipLinkBase(usart, _storage[0], _storage[1], N + 2) {}
+};
+
+}  // namespace lilos
+
+#endif  // LILOS_SLIP_HH_
@@ -19,6 +19,12 @@
  * New tasks can be created at any time, simply by constructing a Task object
  * and calling schedule().  The task will be in the rotation at the next call to
  * yield(), send(), or startTasking().
+ *
+ * Each task has a fixed priority.  Whenever a task yields or blocks, the
+ * scheduler picks the first ready task at the highest priority that has any;
+ * tasks of equal priority take turns in round-robin order.  Lower-priority
+ * tasks only run when every higher-priority task is blocked, so make sure
+ * urgent tasks block regularly!
  */
 
 #include <stdint.h>
@@ -26,6 +32,7 @@
 
 #include <lilos/util.hh>
 #include <lilos/atomic.hh>
+#include <lilos/arch_config.hh>
 
 namespace lilos {
 
@@ -39,6 +46,17 @@ typedef NORETURN (*main_t)();
  */
 typedef uintptr_t msg_t;
 
+/*
+ * Task priorities.  Larger numbers are more urgent.  The lowest priority is
+ * shared with the idle task, which runs whenever nothing else can.  The
+ * scheduler tracks ready priorities in an 8-bit mask, so there can be at most
+ * eight levels.
+ */
+typedef uint8_t priority_t;
+static const priority_t kPriorityLevels = 8;
+static const priority_t kIdlePriority = 0;
+static const priority_t kDefaultPriority = 1;
+
 class Task;
 
 /*
@@ -48,13 +66,21 @@ class Task;
  * TaskLists are doubly-linked, with the link pointers stored in the Tasks
  * themselves.  By implication, a Task can only belong to a single TaskList at
  * a given time.
+ *
+ * A TaskList may have an owner: the Task responsible for servicing the tasks
+ * in it.  Tasks that send() to an owned list lend their priority to its owner
+ * until they're answered.  (Each Task owns its own waiters() list.)
  */
 class TaskList {
   Task * volatile _head;
   Task * volatile _tail;
+  Task *_owner;
 
 public:
-  TaskList() : _head(0), _tail(0) {}
+  TaskList(Task *owner = 0) : _head(0), _tail(0), _owner(owner) {}
+
+  // Returns the Task that services this list, or NULL if there isn't one.
+  Task *owner() { return _owner; }
 
   // Atomically retrieves the first task.
   Task *head();
@@ -70,18 +96,35 @@ public:
    */
   void appendAtomic(Task *);
 
+  /*
+   * Like appendAtomic, but the Task is inserted immediately before 'before',
+   * which must be a member of this list.  If 'before' is NULL, this is
+   * equivalent to appendAtomic.
+   */
+  void insertAtomic(Task *, Task *before);
+
   /*
    * Ensures that the given Task is not in this list.  If the Task was in the
    * list, it is removed; otherwise, nothing changes.
    */
   void removeAtomic(Task *);
 
+  /*
+   * Takes one step of a walk through the list: sets *t to the task after it,
+   * or to the first task if *t is NULL.  Interrupts are disabled only for the
+   * step, so a long list can be walked without holding them off.  Returns
+   * false, leaving *t alone, if *t has been taken out of the list meanwhile
+   * (say, by an ISR answering it); the walk then has to start again.
+   */
+  bool advance(Task **t);
+
   /*
    * Like head(), but not atomic.  This is only safe for use in ISRs or in
    * contexts where interrupts are disabled.  When in doubt, use head().
    */
   Task *headNonAtomic() { return _head; }
-
+  // Like tail(), with the same caveats as headNonAtomic().
+  Task *tailNonAtomic() { return _tail; }
 };
 
 /*
@@ -98,6 +141,10 @@ class Task {
    */
   stack_t _sp;
 
+  // The task's stack area: the lowest address, and the size in bytes.
+  uint8_t *_stack;
+  uint16_t _stackSize;
+
   /*
    * Links for the containing TaskList, if any.  _next and _prev will be NULL
    * iff this task is the last or first in the list (respectively) or the task
@@ -122,6 +169,28 @@ class Task {
    */
   msg_t _message;
 
+  /*
+   * Scheduling priority; see kPriorityLevels.  _priority is the effective
+   * priority, which may be raised above _basePriority while more urgent tasks
+   * are waiting on this one.
+   */
+  priority_t _basePriority;
+  priority_t _priority;
+
+#ifdef LILOS_CPU_STATS
+  // CPU accounting; see "CPU accounting", below.
+  uint32_t _runTime;
+  uint32_t _longestRun;
+  uint32_t _switches;
+  Task *_nextCreated;
+#endif
+
+  /*
+   * Recomputes _priority from _basePriority and the most urgent waiter, and
+   * passes any change along to the owner of the list we're waiting in.
+   */
+  void updatePriority();
+
 public:
   /*
    * Prepares a new Task, but does not schedule it.  (See schedule(), below.)
@@ -129,12 +198,41 @@ public:
    *  entry: a pointer to the Task's outer loop function, which must not return.
    *  stack: a pointer to the *lowest* address in the task's stack area.
    *  stackSize: number of bytes in the stack area.
+   *  priority: scheduling priority, less than kPriorityLevels.  Out-of-range
+   *    values are treated as the highest priority.
    */
-  Task(main_t entry, uint8_t *stack, size_t stackSize);
+  Task(main_t entry, uint8_t *stack, size_t stackSize,
+       priority_t priority = kDefaultPriority);
+
+  /*
+   * Returns the Task's effective scheduling priority.  This is the priority
+   * given at construction, unless a more urgent task is blocked sending to
+   * this one -- in which case this Task inherits the sender's priority until
+   * it answers.
+   */
+  priority_t priority() { return _priority; }
+
+  // Returns the priority given at construction.
+  priority_t basePriority() { return _basePriority; }
 
   // Returns the stack pointer.  Only valid if the Task is not running.
   stack_t &sp() { return _sp; }
 
+  // Returns the lowest address of the Task's stack area.
+  uint8_t *stackBase() { return _stack; }
+
+  // Returns the size of the Task's stack area, in bytes.
+  size_t stackSize() { return _stackSize; }
+
+  /*
+   * Returns the largest number of bytes of stack this Task has used so far.
+   * The constructor fills the stack with a known pattern; this finds the
+   * deepest byte that has been overwritten.  (A task could, in principle,
+   * write the pattern itself -- so treat this as a good estimate, and leave
+   * some margin.)
+   */
+  size_t stackHighWater();
+
   // Checks whether this task is in a certain TaskList.
   bool in(TaskList *tl) { return _container == tl; }
 
@@ -186,7 +284,27 @@ public:
    */
   void detach();
 
+#ifdef LILOS_CPU_STATS
+  // Total time this Task has had the CPU, in microseconds, mod 2^32.
+  uint32_t runTime();
+  // The longest the Task has run without giving up the CPU, in microseconds.
+  uint32_t longestRun();
+  // The number of times the Task has been switched out.
+  uint32_t switches();
+  // The next Task constructed after this one, or NULL.
+  Task *nextCreated() { return _nextCreated; }
+#endif
+
   friend class TaskList;
+  friend msg_t sendVoidBefore(TaskList *, Task *);
+  friend void answerVoid(Task *);
+  friend Task *replyAndReceive(Task *, msg_t);
+  friend msg_t blockIn(TaskList *);
+  friend void wakeLater(Task *);
+  friend void drainPendingWakes();
+#ifdef LILOS_CPU_STATS
+  friend void chargeCurrentTask();
+#endif
 };
 
 
@@ -195,11 +313,13 @@ public:
  */
 
 /*
- * If the given Task is not in any TaskList, adds it to the Ready List, so that
- * it will execute on some future blocking call.  Otherwise -- including if the
- * Task is already in the Ready List -- nothing changes.
+ * If the given Task is not in any TaskList, adds it to the end of the Ready
+ * List for its priority, so that it will execute on some future blocking
+ * call.  Otherwise -- including if the Task is already in the Ready List --
+ * nothing changes.
  *
- * This function's effects are atomic.
+ * This function's effects are atomic.  It's for tasks, and startup code, not
+ * ISRs: an ISR wakes a task with answer().
  */
 void schedule(Task *);
 
@@ -211,13 +331,57 @@ NORETURN startTasking();
 
 /*
  * Pauses execution of the calling Task, allowing some other Task from the
- * Ready List to run.
+ * Ready List to run.  The caller goes to the back of the line at its priority,
+ * so this only gives way to tasks of equal or higher priority.
  */
 void yield();
 
 // Returns a pointer the currently executing Task.
 Task *currentTask();
 
+/*
+ * Preemption
+ *
+ * By default, tasks switch only when they yield or block: a task woken by an
+ * interrupt handler waits for whatever is running to do so.  Building with
+ * LILOS_PREEMPTIVE defined (make PREEMPTIVE=1) bounds that wait instead.  An
+ * interrupt handler that may wake tasks ends by calling rescheduleFromISR(),
+ * which switches straight to the most urgent ready task if it is more urgent
+ * than the interrupted one.  The interrupted task resumes, from the middle of
+ * the handler, when it is next chosen to run.
+ *
+ * The kernel's own handlers (timer and USART) already do this; handlers you
+ * write that call answer() should too.  In cooperative builds the call
+ * compiles to nothing.  If the interrupted task was in the middle of a kernel
+ * call, the switch waits until it's done: the kernel protects its scheduling
+ * state with a lock that only holds off preemption, not interrupts.
+ *
+ * Defining LILOS_TIMESLICE as well (make PREEMPTIVE=1 TIMESLICE=1) makes tasks
+ * of equal priority take turns, changing places on every timer tick (each
+ * overflow of Timer 2 on the AVR) even if none of them blocks.
+ *
+ * Preempted tasks are switched out with an interrupt handler's frame on their
+ * stacks, so preemptive builds need more stack per task; kMinStack accounts
+ * for this.  Anything shared between tasks must, of course, be protected with
+ * ATOMIC or messages, as it would be with an interrupt handler.
+ */
+#ifdef LILOS_PREEMPTIVE
+void rescheduleFromISR();
+#else
+ALWAYS_INLINE void rescheduleFromISR() {}
+#endif
+
+#ifdef LILOS_TIMESLICE
+#ifndef LILOS_PREEMPTIVE
+#error "LILOS_TIMESLICE requires LILOS_PREEMPTIVE"
+#endif
+/*
+ * Sends the current task to the back of the line at its priority.  Called by
+ * the timer tick interrupt, before rescheduleFromISR().
+ */
+void timeSliceFromISR();
+#endif
+
 /*
  * Synchronous messaging support
  *
@@ -244,7 +408,17 @@ Task *currentTask();
  * later date by some other Task.  This can be used to implement mutexes, for
  * example.
  *
- * In either case, the sending Task blocks until some other Task wakes it up
+ * Senders queue in priority order, and in FIFO order among equals.  If the
+ * TaskList has an owner (as every Task's waiters() list does) and the sender
+ * is more urgent than it, the owner inherits the sender's priority until it
+ * answers.  This keeps a low-priority server from holding up a high-priority
+ * client while medium-priority tasks run.
+ *
+ * If the receiving Task (or the owner of the TaskList) is blocked in receive(),
+ * the sender switches directly to it, rather than waiting its turn -- unless
+ * a more urgent task is ready.
+ *
+ * In every case, the sending Task blocks until some other Task wakes it up
  * using answer().  When the sender wakes up, the value returned by send() will
  * be the same one passed to answer().
  */
@@ -253,6 +427,16 @@ msg_t send(TaskList *, msg_t);
 msg_t sendVoid(Task *);
 msg_t sendVoid(TaskList *);
 
+/*
+ * Like sendVoid(TaskList *), but rather than joining the end of the list, the
+ * sender is inserted immediately before 'before' (or at the end, if 'before'
+ * is NULL).  This lets a TaskList be kept in some order other than FIFO.
+ *
+ * If the list is also manipulated by ISRs, disable interrupts while choosing
+ * 'before' and calling this, so that 'before' can't leave the list first.
+ */
+msg_t sendVoidBefore(TaskList *, Task *before);
+
 /*
  * Convenience templates for send that take pointer values.
  */
@@ -281,9 +465,10 @@ void sendPtr(TaskList *tl, A *arg) {
 
 
 /*
- * Returns the Task that has been waiting longest to send a message to the
- * current task.  This is a convenience function for the common case of handling
- * senders in FIFO order; it is equivalent to
+ * Returns the most urgent Task waiting to send a message to the current task,
+ * or the one that has been waiting longest among equals.  This is a
+ * convenience function for the common case of handling senders in order; it is
+ * equivalent to
  *
  *  currentTask()->waiters().head()
  *
@@ -295,15 +480,94 @@ Task *receive();
 
 /*
  * Wakes a Task from send(), with the given return value.
+ *
+ * When a task answers one of its own waiters() with interrupts enabled, it
+ * hands the CPU directly to the sender (unless the sender is less urgent, or
+ * a more urgent task is ready) and goes to the back of the line, as in yield().
+ * Together with send() switching directly to a receiver blocked in receive(),
+ * this makes a round trip cost two context switches, no matter how many other
+ * tasks of the same priority are ready.  So that a chatty pair can't starve
+ * them, one of those gets its turn after every sixteen switches that jump it.
+ *
+ * From an ISR, or with interrupts disabled, answer() just takes the sender
+ * off the list it's waiting in and queues it for the scheduler, which makes it
+ * ready to run the next time it chooses a task.  That's a few instructions,
+ * and keeps ISRs out of the scheduler's data structures entirely.
  */
 void answer(Task *, msg_t);
 
 // Convenience version of answer for senders who don't care about the result.
 void answerVoid(Task *);
 
-// For debugging only: writes task info using the debug API.
+/*
+ * Answers the given sender, which must be one of the current task's waiters,
+ * and then receives the next message -- in a single operation.  This is
+ * equivalent to
+ *
+ *  answer(sender, response);
+ *  return receive();
+ *
+ * but cheaper: if other senders are waiting, the next one is returned without
+ * any context switch, and if not, the current task blocks without going around
+ * receive()'s loop and switches straight to the answered sender (unless a more
+ * urgent task is ready).  A server loop then looks like:
+ *
+ *  Task *sender = receive();
+ *  while (1) {
+ *    msg_t result = process(sender->message());
+ *    sender = replyAndReceive(sender, result);
+ *  }
+ */
+Task *replyAndReceive(Task *sender, msg_t response);
+
+/*
+ * For debugging only: writes task info using the debug API.  In builds with
+ * CPU accounting, this ends with a summary of where the time has gone.
+ */
 void taskDump();
 
+/*
+ * CPU accounting
+ *
+ * Building with LILOS_CPU_STATS defined (make CPUSTATS=1) timestamps every
+ * context switch with micros(), and charges the time since the last one to
+ * the task being switched out.  Each Task keeps its total run time, the
+ * number of times it's been switched out, and its longest single run -- the
+ * last being the one to look at when a cooperative task is holding everyone
+ * else up.  (Time spent in ISRs is charged to whichever task they interrupt.)
+ *
+ * The idle task's run time is the time nothing else wanted the CPU; of that,
+ * idleSleepTime() was spent with the processor asleep.
+ *
+ * This costs 14 bytes of RAM per Task, and a micros() call per switch.
+ */
+#ifdef LILOS_CPU_STATS
+// The first Task constructed.  Follow Task::nextCreated() to find the rest.
+Task *firstTask();
+
+// Microseconds since startTasking(), mod 2^32.
+uint32_t cpuStatsElapsed();
+
+// Microseconds the idle task has spent with the processor asleep.
+uint32_t idleSleepTime();
+#endif
+
+/*
+ * Stack overflow detection
+ *
+ * The lowest byte of each task's stack holds a canary value.  Every time a
+ * task is switched out, the kernel first checks that the context it's about to
+ * save fits above the canary, and that the canary is intact.  If not, the task
+ * has overflowed -- probably corrupting whatever lies below its stack -- and
+ * the kernel calls stackOverflow() with the offending task.
+ *
+ * stackOverflow() is called with interrupts disabled, on the stack main() used
+ * before startTasking(), and must not return.  The default implementation
+ * dumps the task using the debug API (in polled mode; see debugPanic()) and
+ * halts.  To do something else -- reset the system, say -- define your own.
+ */
+NORETURN stackOverflow(Task *);
+
 }  // namespace lilos
 
 /*
@@ -315,12 +579,15 @@ void taskDump();
  *      do work
  *    }
  *  }
+ *
+ * An optional third argument gives the task's priority:
+ *
+ *  TASK(urgentTask, 64, 5) { ... }
  */
-#define TASK(name, stackSize) \
+#define TASK(name, stackSize, ...) \
   uint8_t name ## Stack[stackSize]; \
   NORETURN name ## Main(void); \
-  lilos::Task name(name ## Main, name ## Stack, stackSize); \
+  lilos::Task name(name ## Main, name ## Stack, stackSize, ##__VA_ARGS__); \
   NORETURN name ## Main ()
 
-static const size_t kMinStack = 48;
 #endif  // LILOS_TASK_HH_
@@ -10,7 +10,12 @@
 /*
  * Routines for dealing with time.
  *
- * This module takes over Timer/Counter 2.
+ * The timekeeping itself -- ticks(), micros() and the timer interrupts -- is
+ * provided by mcu/$(MMCU)/src/mcu_time.cc.  On the ATmega328P it takes over
+ * Timer/Counter 2.  The timer is tickless: rather than interrupting every
+ * millisecond, it interrupts only when the earliest pending deadline expires,
+ * plus once per overflow of the 8-bit counter (every 8ms at 8MHz) to keep
+ * ticks() current.
  */
 
 #include <stdint.h>
@@ -23,6 +28,13 @@ void timeInit();
 // Return the number of milliseconds since system start, mod 2^32.
 uint32_t ticks();
 
+/*
+ * Returns the number of microseconds since system start, mod 2^32 (a little
+ * over 71 minutes).  It's only as fine-grained as the timer's counter: 32us
+ * on the ATmega328P at 8MHz.
+ */
+uint32_t micros();
+
 /*
  * Waits for a particular time to pass.  To sleep for n milliseconds, use:
  *  sleepUntil(ticks() + time)
@@ -43,8 +55,66 @@ public:
   void wait();
 };
 
-}  // namespace lilos
+/*
+ * Calls a function once a deadline has passed, from the timer interrupt.
+ * This is for drivers that need a timeout while their tasks are blocked on
+ * something else; tasks that just want to wait should use sleepUntil().
+ *
+ * The function is called with interrupts disabled, and may set() its Alarm
+ * again.  Alarms share the timer with sleeping tasks, so an Alarm costs no
+ * interrupts of its own.
+ *
+ * Unlike the sleep queue, the list of set Alarms is searched with interrupts
+ * disabled -- set() is used from ISRs -- so keep it short.  The kernel uses
+ * one Alarm per USART, for read() timeouts; a handful more is fine.
+ */
+class Alarm {
+  Alarm *_next;
+  uint32_t _deadline;
+  bool _set;
+  void (*_expired)(void *);
+  void *_context;
+
+  friend void timerExpired();
+  friend void sleepUntil(uint32_t);
+
+public:
+  Alarm(void (*expired)(void *), void *context);
+
+  /*
+   * Sets the alarm for the given deadline, replacing any earlier setting.  If
+   * the deadline has already passed, the function is called before set()
+   * returns.  Call with interrupts disabled.
+   */
+  void set(uint32_t deadline);
 
-extern "C" void TIMER2_COMPA_vect(void) __attribute__((signal));
+  // Stops the alarm, if it was set.  Call with interrupts disabled.
+  void cancel();
+
+  // Checks whether the alarm is set and hasn't yet gone off.
+  bool isSet() { return _set; }
+};
+
+/*
+ * The interface between the sleep queue and the MCU's timer.  These are for
+ * use by mcu_time.cc, not applications.
+ */
+
+/*
+ * Arranges for timerExpired() to be called once the given deadline has passed
+ * (or sooner; spurious calls are harmless).  Returns false, arranging nothing,
+ * if the deadline has already passed.  Provided by the MCU, and called with
+ * interrupts disabled.
+ */
+bool timerArm(uint32_t deadline);
+
+/*
+ * Wakes every sleeping task, and fires every Alarm, whose deadline has passed,
+ * and arms the timer for the earliest that hasn't.  Called by the MCU's timer
+ * interrupt handlers.
+ */
+void timerExpired();
+
+}  // namespace lilos
 
 #endif  // LILOS_TIME_HH_
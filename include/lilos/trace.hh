@@ -0,0 +1,83 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_TRACE_HH_
+#define LILOS_TRACE_HH_
+
+/*
+ * Scheduler event tracing
+ *
+ * Building with LILOS_TRACE defined (make TRACE=1) makes the kernel record
+ * what it's doing in a ring buffer: context switches, messages sent,
+ * received and answered, interrupt handlers, and sleeping tasks waking.  Each
+ * event is stamped with micros().  Once the buffer is full, the oldest events
+ * are overwritten.
+ *
+ * traceStream() writes everything recorded so far to debugUsart, as a binary
+ * frame, and empties the buffer.  Call it from a low-priority task.  Capture
+ * the output and feed it to tools/trace2json.py, which finds the frames (text
+ * from the debug API in between is ignored) and turns them into a timeline
+ * that chrome://tracing or ui.perfetto.dev can show.
+ *
+ * The buffer holds LILOS_TRACE_EVENTS events (default 32, at most 255), of 7
+ * bytes each.  Recording takes a micros() call and a few stores.  Nothing is
+ * recorded while traceStream() is busy -- the USART's own interrupts would
+ * drown everything else out -- and the frame that follows says how many
+ * events were lost, whether to that or to overwriting.
+ *
+ * Frame format, little-endian:
+ *   "LTRC", version (1 byte, 1), event count (1 byte), events lost (2 bytes),
+ *   then each event: time in microseconds (4 bytes), type (1 byte), and
+ *   argument (2 bytes).
+ * Tasks are identified by the low 16 bits of their addresses.
+ */
+
+#include <stdint.h>
+
+#include <lilos/util.hh>
+
+namespace lilos {
+
+enum TraceEvent {
+  kTraceSwitch = 1,  // argument: the task switched to
+  kTraceSend,        // argument: the receiving task, or the TaskList if unowned
+  kTraceReceive,     // argument: the sender received
+  kTraceAnswer,      // argument: the sender answered
+  kTraceInterrupt,   // argument: which interrupt (see below)
+  kTraceWake,        // argument: the task whose sleepUntil() deadline passed
+};
+
+/*
+ * Interrupt numbers for kTraceInterrupt events from the kernel's own
+ * handlers.  Number your own from kTraceIrqUser.
+ */
+enum {
+  kTraceIrqTimerOverflow = 0,
+  kTraceIrqTimerMatch,
+  kTraceIrqUsartRx,
+  kTraceIrqUsartTx,  // once per burst of output, as the USART runs dry
+  kTraceIrqTimeSlice,
+  kTraceIrqUser = 16,
+};
+
+#ifdef LILOS_TRACE
+#ifndef LILOS_TRACE_EVENTS
+#define LILOS_TRACE_EVENTS 32
+#endif
+
+// Records an event.  Safe from tasks and ISRs.
+void trace(TraceEvent, uintptr_t argument);
+
+// Writes out and empties the buffer, as described above.
+void traceStream();
+#else
+ALWAYS_INLINE void trace(TraceEvent, uintptr_t) {}
+ALWAYS_INLINE void traceStream() {}
+#endif
+
+}  // namespace lilos
+
+#endif  // LILOS_TRACE_HH_
@@ -12,21 +12,83 @@
 #include <lilos/pgmspace.hh>
 #include <lilos/static_assert.hh>
 #include <lilos/task.hh>
+#include <lilos/time.hh>
+
+#ifndef LILOS_USART_RX_BUFFER
+#define LILOS_USART_RX_BUFFER 16
+#endif
+
+#ifndef LILOS_USART_TX_BUFFER
+#define LILOS_USART_TX_BUFFER 16
+#endif
 
 namespace lilos {
 
-// Opaque declaration of hardware USART struct.
-class USARTRegisters;
+class SlipLinkBase;
+
+/*
+ * Size of each USART's receive buffer, in bytes: LILOS_USART_RX_BUFFER, a
+ * power of two no larger than 128.  This sets how long the task reading a
+ * USART may go without running before input is lost.  At 115200 baud a byte
+ * arrives about every 87 microseconds, so the default of 16 allows about
+ * 1.4ms; define it larger for faster links or longer-running tasks.
+ */
+static const uint8_t kUsartRxBuffer = LILOS_USART_RX_BUFFER;
+
+/*
+ * Size of each USART's transmit buffer, in bytes: LILOS_USART_TX_BUFFER, also
+ * a power of two no larger than 128.  Writes no larger than the free space
+ * are copied and don't block.
+ */
+static const uint8_t kUsartTxBuffer = LILOS_USART_TX_BUFFER;
 
 /*
- * A USART peripheral.  Each particular type of MCU has static instances of
- * this class defined in mcu/$(MCU)/include/lilos/mcu_usart.hh.
+ * A USART peripheral.  This class holds everything that doesn't depend on
+ * which USART it is, and is what drivers layered on a USART (such as
+ * SlipLink) deal in.  Each MCU derives a USARTPort<N> template from it in
+ * mcu/$(MCU)/include/lilos/mcu_usart.hh, which adds initialize(), writeNow()
+ * and the interrupt handlers, with the registers resolved at compile time,
+ * and defines the instances: usart0, and so on.
+ *
+ * Received bytes are handed straight to a task waiting in read(), if there is
+ * one -- stored directly into its buffer, for the bulk reads -- and otherwise
+ * kept in a ring buffer until read() asks for them.  Bytes that arrive when
+ * the buffer is full are dropped and counted; see rxOverruns().
+ *
+ * Writes that fit in the transmit ring buffer are copied into it, and return
+ * at once; the transmit interrupt drains it.  Larger writes, and writes made
+ * while the buffer is full, aren't copied: the writer blocks while the
+ * interrupt sends straight from its memory -- RAM or program memory -- and is
+ * woken once, when the last byte has gone.  Blocked writers are served in the
+ * order they arrived, whatever their priorities, so that one can't cut into
+ * another's block halfway through.
  */
 class USART {
-  USARTRegisters *_reg;
   TaskList _transmitTasks;
   TaskList _receiveTasks;
 
+  // Received bytes not yet read: _rxCount of them, oldest at _rxHead.
+  uint8_t _rxBuffer[kUsartRxBuffer];
+  volatile uint8_t _rxHead;
+  volatile uint8_t _rxCount;
+  volatile uint16_t _rxOverruns;
+  // Times out the first reader's read, if it asked for a timeout.
+  Alarm _rxAlarm;
+
+  // If set, receives all input in place of read(); see slip.hh.
+  SlipLinkBase *_link;
+
+  // Bytes waiting to be transmitted: _txCount of them, oldest at _txHead.
+  uint8_t _txBuffer[kUsartTxBuffer];
+  volatile uint8_t _txHead;
+  volatile uint8_t _txCount;
+
+  // Provided by the USARTPort.  The first enables the transmit interrupt;
+  // the second, which may be null, is called when read() makes room in a
+  // full receive buffer.
+  void (*_startTransmitting)();
+  void (*_resumeReceiving)();
+
 public:
   enum DataBits {
     DATA_5,
@@ -48,13 +110,37 @@ public:
   };
 
 
-  USART(USARTRegisters *reg) : _reg(reg) {}
-
-  void initialize(uint32_t baudrate, DataBits, Parity, StopBits);
-
+  // Checks whether read() would return without blocking.
   bool available();
+
+  /*
+   * Returns the oldest byte received and not yet read, blocking until one
+   * arrives if necessary.
+   */
   uint8_t read();
 
+  /*
+   * Reads up to n bytes into buf, returning once all n have arrived -- or, if
+   * timeout is nonzero, once that many milliseconds pass without a byte after
+   * the first.  Returns the number read.  Bytes go from the receive interrupt
+   * straight into buf, and the task is only woken once, at the end.
+   */
+  size_t read(uint8_t *buf, size_t n, uint16_t timeout = 0);
+
+  /*
+   * Like read(buf, max, timeout), but also stops after the byte delim, which
+   * is stored in buf and counted.
+   */
+  size_t readUntil(uint8_t *buf, size_t max, uint8_t delim,
+                   uint16_t timeout = 0);
+
+  /*
+   * Returns the number of received bytes lost since initialization, either
+   * because the receive buffer was full or because the hardware overran.
+   * Saturates at 65535.
+   */
+  uint16_t rxOverruns();
+
   void write(uint8_t);
   void write(const uint8_t *, size_t);
   void write_P(const prog_char *, size_t);
@@ -63,14 +149,52 @@ public:
    * These functions are intended for use from interrupt handlers,
    * but could be appropriated for other purposes....
    */
-  bool senderWaiting();
-  uint8_t readAndUnblockSender();
-  bool receiverWaiting();
-  void unblockReceiver(uint8_t);
+
+  /*
+   * Takes the next byte to transmit: from the buffer, or else from the first
+   * blocked writer.  Returns false if there's nothing to send.
+   */
+  bool transmitFromISR(uint8_t *data);
+
+  /*
+   * Delivers a received byte to a waiting task or the receive buffer.  If
+   * lostBefore is true, the hardware dropped a byte before this one.
+   */
+  void receiveFromISR(uint8_t data, bool lostBefore = false);
+  bool rxBufferFull();
+
+protected:
+  USART(void (*startTransmitting)(), void (*resumeReceiving)())
+    : _rxHead(0), _rxCount(0), _rxOverruns(0),
+      _rxAlarm(rxTimeout, this), _link(0), _txHead(0), _txCount(0),
+      _startTransmitting(startTransmitting),
+      _resumeReceiving(resumeReceiving) {}
 
 private:
-  uint8_t readNow();
-  void activateTransmission();
+  struct RxBlock;
+  uint8_t takeNonAtomic();
+  size_t receive(uint8_t *, size_t max, int16_t delim, uint16_t timeout);
+  static void rxTimeout(void *);
+
+  /*
+   * A block of bytes lent to the transmit interrupt by a writer waiting in
+   * _transmitTasks.  The interrupt reads it straight from the writer's memory
+   * -- or, if source is set, calls source for each byte instead, until it
+   * returns true for the last -- and answers the writer once it's all gone.
+   */
+  struct TxBlock {
+    const uint8_t *data;
+    size_t length;
+    bool flash;
+    bool (*source)(TxBlock *, uint8_t *);
+  };
+  void transmit(const uint8_t *, size_t, bool flash);
+  // Queues a block and waits for it to be sent.  Interrupts must be disabled.
+  void transmitBlock(TxBlock *);
+
+  friend class SlipLinkBase;
+
+  void countOverrun();
 };
 
 }  // namespace lilos
@@ -15,6 +15,8 @@
 #include <lilos/usart.hh>
 #include <lilos/time.hh>
 #include <lilos/debug.hh>
+#include <lilos/latency.hh>
+#include <lilos/trace.hh>
 #include <lilos/pgmspace.hh>
 
 using lilos::debugWrite;
@@ -29,10 +31,10 @@ using lilos::debugLn;
 TASK(serverTask, kMinStack) {
   static const lilos::port::Pin led = PIN(B, 5);
   led.setDirection(lilos::port::OUT);
+  lilos::Task *sender = lilos::receive();
   while (1) {
-    lilos::Task *sender = lilos::receive();
     led.setValue(sender->message());
-    lilos::answerVoid(sender);
+    sender = lilos::replyAndReceive(sender, 0);
   }
 }
 
@@ -43,6 +45,10 @@ TASK(debugTask, kMinStack + 64) {
   lilos::IntervalTimer timer(1000);
   while (1) {
     lilos::taskDump();
+#ifdef LILOS_LATENCY
+    lilos::latencyDump();
+#endif
+    lilos::traceStream();
     timer.wait();
   }
 }
@@ -64,15 +70,22 @@ TASK(flashTask, kMinStack + 16) {
   }
 }
 
-TASK(echoTask, kMinStack) {
+TASK(echoTask, kMinStack + 32) {
+  // Echo input a burst at a time: the task wakes when 16 bytes have arrived,
+  // or input pauses for 2ms.
+  uint8_t buf[16];
   while (1) {
-    lilos::usart0.write(lilos::usart0.read());
+    size_t n = lilos::usart0.read(buf, sizeof(buf), 2);
+    lilos::usart0.write(buf, n);
   }
 }
 
-NORETURN main() {
+int main() {
   lilos::timeInit();
   lilos::debugInit();
+#ifdef LILOS_LATENCY
+  lilos::latencyInit();
+#endif
   sei();
 
   _delay_ms(1000);
@@ -7,11 +7,145 @@
 #ifndef LILOS_MCU_USART_HH_
 #define LILOS_MCU_USART_HH_
 
+/*
+ * The AVR's USARTs.  USARTPort<N> is USART N, with its registers named at
+ * compile time through USARTRegisters<N>, so that each access is a single
+ * load or store -- as cheap as the GPIO layer.  Supporting a part with more
+ * USARTs takes a USARTRegisters specialization and a LILOS_USART_PORT line
+ * for each; the code is shared.
+ */
+
+#include <avr/io.h>
+
+#include <lilos/static_assert.hh>
+#include <lilos/trace.hh>
+#include <lilos/util.hh>
+
+/*
+ * The largest baud rate error initialize<baudrate>() will accept, in
+ * thousandths.  The default, 2%, is what the datasheet recommends for 8 data
+ * bits; a link between two AVRs running from the same kind of clock can
+ * tolerate more.
+ */
+#ifndef LILOS_USART_MAX_BAUD_ERROR
+#define LILOS_USART_MAX_BAUD_ERROR 20
+#endif
+
 namespace lilos {
 
-extern USART usart0;
+/*
+ * The baud rate divisor for a given clock, baud rate, and clocks per bit (16
+ * normally, 8 in double-speed mode), rounded to the nearest, and how far off
+ * it leaves the rate, in thousandths.
+ */
+template <uint32_t Clock, uint32_t Baud, uint32_t Scale>
+struct BaudDivisor {
+  static const uint32_t kNearest = (Clock + Scale * Baud / 2) / (Scale * Baud);
+  static const uint32_t kDivisor = kNearest ? kNearest : 1;
+
+  // The clock rate that would make this divisor exact.
+  static const uint32_t kClock = Scale * Baud * kDivisor;
+  static const uint32_t kError =
+      (kClock > Clock ? kClock - Clock : Clock - kClock) * 1000ULL / kClock;
+};
+
+/*
+ * Chooses, at compile time, the USART setting closest to a baud rate at F_CPU:
+ * normal or double-speed (U2X) mode, and the UBRR value.  Double speed allows
+ * rates up to F_CPU / 8 -- 1Mbaud at 8MHz -- and often comes closer at high
+ * rates; normal mode samples each bit more times, so it wins ties.
+ */
+template <uint32_t Baud>
+struct BaudRate {
+  typedef BaudDivisor<F_CPU, Baud, 16> Normal;
+  typedef BaudDivisor<F_CPU, Baud, 8> Double;
+
+  static const bool kDoubleSpeed =
+      Double::kError < Normal::kError && Double::kDivisor <= 4096;
+  static const uint32_t kDivisor =
+      kDoubleSpeed ? Double::kDivisor : Normal::kDivisor;
+
+  static const uint16_t kUbrr = kDivisor - 1;
+  static const uint32_t kError = kDoubleSpeed ? Double::kError : Normal::kError;
+};
+
+/*
+ * The registers of USART N.  The bits within them are in the same places for
+ * every USART, so the code uses USART0's names for them.
+ */
+template <uint8_t N> struct USARTRegisters;
+
+template <> struct USARTRegisters<0> {
+  ALWAYS_INLINE static volatile uint8_t &ucsra() { return UCSR0A; }
+  ALWAYS_INLINE static volatile uint8_t &ucsrb() { return UCSR0B; }
+  ALWAYS_INLINE static volatile uint8_t &ucsrc() { return UCSR0C; }
+  ALWAYS_INLINE static volatile uint16_t &ubrr() { return UBRR0; }
+  ALWAYS_INLINE static volatile uint8_t &udr() { return UDR0; }
+};
+
+template <uint8_t N>
+class USARTPort : public USART {
+  typedef USARTRegisters<N> Reg;
+
+  static void startTransmitting() {
+    Reg::ucsrb() |= _BV(UDRIE0);
+  }
+
+  void configure(uint16_t ubrr, bool doubleSpeed, DataBits, Parity, StopBits);
+
+public:
+  USARTPort() : USART(startTransmitting, 0) {}
+
+  /*
+   * Sets the USART up at the given baud rate, choosing the divisor and
+   * double-speed mode at compile time.  Fails to compile if the rate can't be
+   * had within LILOS_USART_MAX_BAUD_ERROR at F_CPU -- 115200 at 8MHz, for
+   * example, is 3.5% out.
+   */
+  template <uint32_t Baud>
+  void initialize(DataBits db, Parity p, StopBits sb) {
+    static_assert(BaudRateTooLow, BaudRate<Baud>::kDivisor <= 4096);
+    static_assert(BaudRateErrorTooLarge,
+                  BaudRate<Baud>::kError <= LILOS_USART_MAX_BAUD_ERROR);
+    configure(BaudRate<Baud>::kUbrr, BaudRate<Baud>::kDoubleSpeed, db, p, sb);
+  }
+
+  /*
+   * Like initialize<baudrate>(), for rates only known at run time.  The
+   * divisor is chosen the same way, but nothing checks the result.
+   */
+  void initialize(uint32_t baudrate, DataBits, Parity, StopBits);
+
+  /*
+   * Transmits a byte by polling the hardware, without interrupts or blocking,
+   * after anything already in the transmit buffer.  This is only for use when
+   * the scheduler can't be trusted, such as from fault handlers.
+   */
+  void writeNow(uint8_t);
+
+  // The bodies of the interrupt handlers that LILOS_USART_PORT defines.
+  ALWAYS_INLINE void receiveInterrupt() {
+    trace(kTraceInterrupt, kTraceIrqUsartRx);
+    // The overrun flag is only valid until UDR is read.
+    bool lost = Reg::ucsra() & _BV(DOR0);
+    receiveFromISR(Reg::udr(), lost);
+  }
+
+  ALWAYS_INLINE void transmitInterrupt() {
+    uint8_t b;
+    if (transmitFromISR(&b)) {
+      Reg::udr() = b;
+    } else {
+      // Traced only here, once per burst: a trace per byte would fill the
+      // buffer.
+      trace(kTraceInterrupt, kTraceIrqUsartTx);
+      Reg::ucsrb() &= ~_BV(UDRIE0);
+    }
+  }
+};
+
+extern USARTPort<0> usart0;
 
 }  // namespace lilos
 
 #endif  // LILOS_MCU_USART_HH_
-
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include <lilos/latency.hh>
+
+#ifdef LILOS_LATENCY
+
+namespace lilos {
+
+/*
+ * Timer/Counter 1 runs freely at clk/8.  Compare match B interrupts every
+ * kSamplePeriod ticks, and records how long after the match it got to run.
+ * (The kernel benchmarks use Timer 1 too, so they can't be built with
+ * LATENCY=1.)
+ */
+static const uint16_t kSamplePeriod = 4096;
+
+static const prog_char kSampleName[] PROGMEM = "interrupt latency";
+static LatencySite sampleSite = { kSampleName, 0 };
+
+void latencyTimerInit() {
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);  // clk/8
+  OCR1B = TCNT1 + kSamplePeriod;
+  TIFR1 = _BV(OCF1B);
+  TIMSK1 |= _BV(OCIE1B);
+}
+
+// Called with interrupts disabled, so that the 16-bit read can't be torn.
+uint16_t latencyNow() {
+  return TCNT1;
+}
+
+}  // namespace lilos
+
+using namespace lilos;
+
+ISR(TIMER1_COMPB_vect) {
+  uint16_t match = OCR1B;
+  latencyRecord(&sampleSite, TCNT1 - match);
+  OCR1B = match + kSamplePeriod;
+}
+
+#endif  // LILOS_LATENCY
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include <lilos/atomic.hh>
+#include <lilos/task.hh>
+#include <lilos/time.hh>
+#include <lilos/trace.hh>
+
+namespace lilos {
+
+/*
+ * Timer/Counter 2 runs freely at clk/256 in normal mode.  Rather than
+ * interrupting every millisecond, it interrupts on overflow (to keep the
+ * millisecond count current) and, using compare match A, at the earliest
+ * pending deadline.  An idle system takes only the overflow interrupts.
+ */
+static const uint16_t kMicrosPerCount = 256UL * 1000000UL / F_CPU;
+static const uint16_t kMicrosPerOverflow = 256 * kMicrosPerCount;
+// Deadlines more than this many milliseconds out can't expire before the next
+// overflow.
+static const uint8_t kMillisPerOverflow = (kMicrosPerOverflow + 999) / 1000;
+
+// Milliseconds since system start, as of the last overflow.
+static volatile uint32_t timerTicks = 0;
+// Microseconds past timerTicks, as of the last overflow.  Always < 1000.
+static volatile uint16_t timerMicros = 0;
+
+void timeInit() {
+  TCCR2A = 0;  // Normal mode
+  TCCR2B = 6;  // clk/256
+  TIMSK2 = _BV(TOIE2);  // Compare match A is enabled on demand.
+}
+
+/*
+ * Reads the time as whole milliseconds plus microseconds, which may come to
+ * more than a millisecond.  Interrupts must be disabled.
+ */
+static uint32_t readTime(uint16_t *us) {
+  uint32_t ms = timerTicks;
+  uint16_t u = timerMicros;
+  uint8_t count = TCNT2;
+  // Account for an overflow that happened while interrupts were disabled.
+  if ((TIFR2 & _BV(TOV2)) && count < 255) u += kMicrosPerOverflow;
+  *us = u + count * kMicrosPerCount;
+  return ms;
+}
+
+uint32_t ticks() {
+  ATOMIC {
+    uint16_t us;
+    uint32_t ms = readTime(&us);
+    while (us >= 1000) {
+      us -= 1000;
+      ms++;
+    }
+    return ms;
+  }
+}
+
+uint32_t micros() {
+  ATOMIC {
+    uint16_t us;
+    uint32_t ms = readTime(&us);
+    return ms * 1000 + us;
+  }
+}
+
+/*
+ * Programs compare match A to fire at the given deadline, if that comes before
+ * the next overflow; if not, the overflow handler will get to it.
+ */
+bool timerArm(uint32_t deadline) {
+  // If an overflow is pending, timerTicks is stale.  Let the handler sort it
+  // out: it will rearm as soon as interrupts are enabled.
+  if (TIFR2 & _BV(TOV2)) return true;
+
+  int32_t ms = deadline - timerTicks;
+  if (ms > kMillisPerOverflow) return true;
+  if (ms <= 0) return false;
+
+  // Round up, so that we never wake a task early.
+  uint16_t us = (uint16_t) ms * 1000 - timerMicros;
+  uint16_t count = (us + kMicrosPerCount - 1) / kMicrosPerCount;
+  if (count > 255) return true;
+
+  OCR2A = count;
+  TIFR2 = _BV(OCF2A);  // Discard any stale match.
+  TIMSK2 |= _BV(OCIE2A);
+  // If the counter got there first, we've missed the match.
+  if (TCNT2 < count) return true;
+  TIMSK2 &= ~_BV(OCIE2A);
+  return false;
+}
+
+}  // namespace lilos
+
+using namespace lilos;
+
+ISR(TIMER2_OVF_vect) {
+  trace(kTraceInterrupt, kTraceIrqTimerOverflow);
+  uint32_t ms = timerTicks;
+  uint16_t us = timerMicros + kMicrosPerOverflow;
+  while (us >= 1000) {
+    us -= 1000;
+    ms++;
+  }
+  timerTicks = ms;
+  timerMicros = us;
+
+  TIMSK2 &= ~_BV(OCIE2A);
+  timerExpired();
+#ifdef LILOS_TIMESLICE
+  trace(kTraceInterrupt, kTraceIrqTimeSlice);
+  timeSliceFromISR();
+#endif
+  rescheduleFromISR();
+}
+
+ISR(TIMER2_COMPA_vect) {
+  trace(kTraceInterrupt, kTraceIrqTimerMatch);
+  TIMSK2 &= ~_BV(OCIE2A);
+  timerExpired();
+  rescheduleFromISR();
+}
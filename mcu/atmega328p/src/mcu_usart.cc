@@ -6,28 +6,50 @@
 
 #include <lilos/usart.hh>
 #include <lilos/mcu_usart.hh>
+#include <lilos/trace.hh>
 
 namespace lilos {
 
-/*
- * Because the 328P has only one USART, this module doesn't bother defining
- * USARTRegisters.
- */
+// Rounds F_CPU / (scale * baudrate) to the nearest, and at least 1.
+static uint32_t divisor(uint32_t baudrate, uint8_t scale) {
+  uint32_t clocks = scale * baudrate;
+  uint32_t d = (F_CPU + clocks / 2) / clocks;
+  return d ? d : 1;
+}
+
+// How far a divisor is from exact, measured as clock cycles per second.
+static uint32_t error(uint32_t baudrate, uint8_t scale, uint32_t d) {
+  uint32_t clock = scale * baudrate * d;
+  return clock > F_CPU ? clock - F_CPU : F_CPU - clock;
+}
 
-USART usart0(0);
+template <uint8_t N>
+void USARTPort<N>::initialize(uint32_t baudrate, DataBits db, Parity p,
+                              StopBits sb) {
+  // As BaudRate<> does it at compile time, but skipping the division that
+  // turns the clock error into a relative one.  Both candidates' clocks are
+  // within a few percent of F_CPU, so the comparison rarely differs.
+  uint32_t normal = divisor(baudrate, 16);
+  uint32_t fast = divisor(baudrate, 8);
+  bool doubleSpeed = error(baudrate, 8, fast) < error(baudrate, 16, normal)
+                  && fast <= 4096;
+  configure((doubleSpeed ? fast : normal) - 1, doubleSpeed, db, p, sb);
+}
 
-void USART::initialize(uint32_t baudrate, DataBits db, Parity p, StopBits sb) {
+template <uint8_t N>
+void USARTPort<N>::configure(uint16_t ubrr, bool doubleSpeed, DataBits db,
+                             Parity p, StopBits sb) {
   ATOMIC {
-    UBRR0 = (uint16_t) (F_CPU / 16 / baudrate - 1);
+    Reg::ubrr() = ubrr;
 
-    UCSR0A = 0;
+    Reg::ucsra() = doubleSpeed ? _BV(U2X0) : 0;
 
     uint8_t b = _BV(RXCIE0) | _BV(RXEN0) | _BV(TXEN0);
     switch (db) {
       case DATA_9: b |= _BV(UCSZ02); break;
       default: break;
     }
-    UCSR0B = b;
+    Reg::ucsrb() = b;
 
     uint8_t parityFlags;
     switch (p) {
@@ -51,38 +73,42 @@ void USART::initialize(uint32_t baudrate, DataBits db, Parity p, StopBits sb) {
       case DATA_9: dataBitsFlags = 0b11; break;
     }
 
-    UCSR0C = (parityFlags << UPM00)
-           | (stopBitFlags << USBS0)
-           | (dataBitsFlags << UCSZ00);
+    Reg::ucsrc() = (parityFlags << UPM00)
+                 | (stopBitFlags << USBS0)
+                 | (dataBitsFlags << UCSZ00);
   }
 }
 
-uint8_t USART::readNow() {
-  return UDR0;
-}
-
-void USART::activateTransmission() {
-  UCSR0B |= _BV(UDRIE0);
-}
-
-bool USART::available() {
-  return UCSR0A & _BV(RXC0);
+template <uint8_t N>
+void USARTPort<N>::writeNow(uint8_t b) {
+  ATOMIC {
+    uint8_t buffered;
+    while (transmitFromISR(&buffered)) {
+      while (!(Reg::ucsra() & _BV(UDRE0)));
+      Reg::udr() = buffered;
+    }
+    while (!(Reg::ucsra() & _BV(UDRE0)));
+    Reg::udr() = b;
+  }
 }
 
 }  // namespace lilos
 
-using namespace lilos;
-
-ISR(USART_UDRE_vect) {
-  if (usart0.senderWaiting()) {
-    UDR0 = usart0.readAndUnblockSender();
-  } else {
-    UCSR0B &= ~_BV(UDRIE0);
+/*
+ * Defines USART n's instance, usart<n>, and its interrupt handlers.
+ */
+#define LILOS_USART_PORT(n, rxVector, udreVector) \
+  namespace lilos { \
+  template class USARTPort<n>; \
+  USARTPort<n> usart##n; \
+  } \
+  ISR(rxVector) { \
+    lilos::usart##n.receiveInterrupt(); \
+    lilos::rescheduleFromISR(); \
+  } \
+  ISR(udreVector) { \
+    lilos::usart##n.transmitInterrupt(); \
+    lilos::rescheduleFromISR(); \
   }
-}
 
-ISR(USART_RX_vect) {
-  if (usart0.receiverWaiting()) {
-    usart0.unblockReceiver(UDR0);
-  }
-}
+LILOS_USART_PORT(0, USART_RX_vect, USART_UDRE_vect)
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#ifndef LILOS_MCU_USART_HH_
+#define LILOS_MCU_USART_HH_
+
+namespace lilos {
+
+/*
+ * The host has one USART, USARTPort<0>: standard input and output.  See
+ * mcu_usart.cc.
+ */
+template <uint8_t N>
+class USARTPort : public USART {
+  static void startTransmitting();
+  static void resumeReceiving();
+
+public:
+  USARTPort() : USART(startTransmitting, resumeReceiving) {}
+
+  // The settings are ignored.
+  template <uint32_t Baud>
+  void initialize(DataBits db, Parity p, StopBits sb) {
+    initialize(Baud, db, p, sb);
+  }
+  void initialize(uint32_t baudrate, DataBits, Parity, StopBits);
+
+  /*
+   * Transmits a byte immediately, without interrupts or blocking, after
+   * anything already in the transmit buffer.  This is only for use when the
+   * scheduler can't be trusted, such as from fault handlers.
+   */
+  void writeNow(uint8_t);
+};
+
+extern USARTPort<0> usart0;
+
+}  // namespace lilos
+
+#endif  // LILOS_MCU_USART_HH_
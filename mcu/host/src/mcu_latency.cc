@@ -0,0 +1,33 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <time.h>
+
+#include <lilos/latency.hh>
+
+#ifdef LILOS_LATENCY
+
+namespace lilos {
+
+/*
+ * Ticks come from the monotonic clock, scaled to what they'd be at F_CPU.
+ * There's no sampling interrupt: signal delivery says more about Linux than
+ * about the kernel.
+ */
+static const uint64_t kNanosPerTick =
+    1000000000ULL * kLatencyCyclesPerTick / F_CPU;
+
+void latencyTimerInit() {}
+
+uint16_t latencyNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec) / kNanosPerTick;
+}
+
+}  // namespace lilos
+
+#endif  // LILOS_LATENCY
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <lilos/atomic.hh>
+#include <lilos/task.hh>
+#include <lilos/time.hh>
+#include <lilos/trace.hh>
+
+namespace lilos {
+
+/*
+ * Time comes from the monotonic clock, and deadlines from a one-shot interval
+ * timer delivering SIGALRM -- tickless, like the AVR version.  When time
+ * slicing, a second timer ticks every kSliceMicros of CPU time.
+ */
+
+// The monotonic clock at timeInit(), in microseconds.
+static uint64_t startMicros;
+
+static uint64_t monotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void timerInterrupt() {
+  trace(kTraceInterrupt, kTraceIrqTimerMatch);
+  timerExpired();
+}
+
+#ifdef LILOS_TIMESLICE
+static const uint32_t kSliceMicros = 10000;
+
+static void sliceInterrupt() {
+  trace(kTraceInterrupt, kTraceIrqTimeSlice);
+  timeSliceFromISR();
+}
+#endif
+
+void timeInit() {
+  startMicros = monotonicMicros();
+  hostAttachInterrupt(SIGALRM, timerInterrupt);
+
+#ifdef LILOS_TIMESLICE
+  hostAttachInterrupt(SIGVTALRM, sliceInterrupt);
+  struct itimerval it;
+  it.it_interval.tv_sec = 0;
+  it.it_interval.tv_usec = kSliceMicros;
+  it.it_value = it.it_interval;
+  setitimer(ITIMER_VIRTUAL, &it, 0);
+#endif
+}
+
+uint32_t ticks() {
+  return (monotonicMicros() - startMicros) / 1000;
+}
+
+uint32_t micros() {
+  return monotonicMicros() - startMicros;
+}
+
+bool timerArm(uint32_t deadline) {
+  uint64_t now = monotonicMicros() - startMicros;
+  int32_t ms = deadline - (uint32_t) (now / 1000);
+  if (ms <= 0) return false;
+
+  // Round up, so that we never wake a task early.
+  uint64_t us = (now / 1000 + ms) * 1000 - now;
+
+  struct itimerval it;
+  it.it_interval.tv_sec = 0;
+  it.it_interval.tv_usec = 0;
+  it.it_value.tv_sec = us / 1000000;
+  it.it_value.tv_usec = us % 1000000;
+  setitimer(ITIMER_REAL, &it, 0);
+  return true;
+}
+
+}  // namespace lilos
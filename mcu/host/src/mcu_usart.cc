@@ -0,0 +1,109 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <lilos/usart.hh>
+#include <lilos/mcu_usart.hh>
+#include <lilos/trace.hh>
+
+namespace lilos {
+
+/*
+ * The host's one USART is the process's standard input and output.  Arriving
+ * input raises SIGIO, which serves as the receive interrupt; the transmit
+ * interrupt is raised in software, since stdout is always ready.
+ *
+ * The kernel ends lines with a carriage return, for the benefit of serial
+ * terminals.  Like a terminal, we map those to newlines on output -- but only
+ * if the output is a terminal, so that binary output (such as traceStream()'s)
+ * survives being captured to a file.
+ */
+
+static const int kRxFd = 0;
+static const int kTxFd = 1;
+
+// Input we've read from the OS but not yet delivered, or -1.  This plays the
+// part of the receive data register.
+static int rxData = -1;
+
+static uint8_t rxInterrupt;
+static uint8_t txInterrupt;
+static bool txIsTerminal;
+
+static bool rxReady() {
+  if (rxData >= 0) return true;
+
+  struct pollfd p = { kRxFd, POLLIN, 0 };
+  uint8_t b;
+  if (poll(&p, 1, 0) == 1 && read(kRxFd, &b, 1) == 1) rxData = b;
+  return rxData >= 0;
+}
+
+static uint8_t rxTake() {
+  uint8_t b = rxData;
+  rxData = -1;
+  return b;
+}
+
+static void txByte(uint8_t b) {
+  if (b == '\r' && txIsTerminal) b = '\n';
+  while (::write(kTxFd, &b, 1) < 0 && errno == EINTR);
+}
+
+static void rxInterruptHandler() {
+  trace(kTraceInterrupt, kTraceIrqUsartRx);
+  // Unlike the wire, the OS will hold input until there's room for it.
+  while (!usart0.rxBufferFull() && rxReady()) {
+    usart0.receiveFromISR(rxTake());
+  }
+}
+
+static void txInterruptHandler() {
+  uint8_t b;
+  while (usart0.transmitFromISR(&b)) txByte(b);
+  // As on the AVR, traced once the output runs dry.
+  trace(kTraceInterrupt, kTraceIrqUsartTx);
+}
+
+template <>
+void USARTPort<0>::initialize(uint32_t, DataBits, Parity, StopBits) {
+  rxInterrupt = hostAttachInterrupt(SIGIO, rxInterruptHandler);
+  txInterrupt = hostAttachInterrupt(0, txInterruptHandler);
+  txIsTerminal = isatty(kTxFd);
+
+  fcntl(kRxFd, F_SETOWN, getpid());
+  fcntl(kRxFd, F_SETFL, fcntl(kRxFd, F_GETFL) | O_ASYNC);
+  // Collect anything that arrived before SIGIO was armed.
+  hostRaiseInterrupt(rxInterrupt);
+}
+
+template <>
+void USARTPort<0>::writeNow(uint8_t b) {
+  ATOMIC {
+    uint8_t buffered;
+    while (transmitFromISR(&buffered)) txByte(buffered);
+    txByte(b);
+  }
+}
+
+template <>
+void USARTPort<0>::startTransmitting() {
+  hostRaiseInterrupt(txInterrupt);
+}
+
+template <>
+void USARTPort<0>::resumeReceiving() {
+  hostRaiseInterrupt(rxInterrupt);
+}
+
+USARTPort<0> usart0;
+
+}  // namespace lilos
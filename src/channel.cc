@@ -0,0 +1,113 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <string.h>
+
+#include <lilos/atomic.hh>
+#include <lilos/channel.hh>
+#include <lilos/task.hh>
+
+namespace lilos {
+
+ChannelBase::ChannelBase(uint8_t *buffer, uint8_t elementSize,
+                         uint8_t capacity)
+  : _buffer(buffer),
+    _elementSize(elementSize),
+    _capacity(capacity),
+    _head(0),
+    _count(0) {}
+
+// Wakes the first task in the list, if any.
+static void wakeFirst(TaskList *list) {
+  Task *t = list->headNonAtomic();
+  if (t) answerVoid(t);
+}
+
+/*
+ * The ring is copied in at most two runs: up to the end of the buffer, and
+ * then from the start.
+ */
+size_t ChannelBase::putNonAtomic(const uint8_t *src, size_t n) {
+  uint8_t count = _count;
+  size_t room = _capacity - count;
+  if (n > room) n = room;
+  if (!n) return 0;
+
+  // The indices are computed wider than they're stored, since they can pass
+  // 255 before wrapping.
+  uint16_t tail = _head + count;
+  if (tail >= _capacity) tail -= _capacity;
+  size_t first = _capacity - tail;
+  if (first > n) first = n;
+
+  memcpy(_buffer + tail * _elementSize, src, first * _elementSize);
+  memcpy(_buffer, src + first * _elementSize, (n - first) * _elementSize);
+  _count = count + n;
+
+  // Wake a consumer.  If there's room left, let the next producer in, too.
+  wakeFirst(&_getters);
+  if (_count < _capacity) wakeFirst(&_putters);
+  return n;
+}
+
+size_t ChannelBase::getNonAtomic(uint8_t *dst, size_t n) {
+  uint8_t count = _count;
+  if (n > count) n = count;
+  if (!n) return 0;
+
+  uint16_t head = _head;
+  size_t first = _capacity - head;
+  if (first > n) first = n;
+
+  memcpy(dst, _buffer + head * _elementSize, first * _elementSize);
+  memcpy(dst + first * _elementSize, _buffer, (n - first) * _elementSize);
+
+  head += n;
+  if (head >= _capacity) head -= _capacity;
+  _head = head;
+  _count = count - n;
+
+  // Wake a producer.  If there's data left, let the next consumer in, too.
+  wakeFirst(&_putters);
+  if (_count) wakeFirst(&_getters);
+  return n;
+}
+
+size_t ChannelBase::tryPutBytes(const uint8_t *src, size_t n) {
+  ATOMIC { n = putNonAtomic(src, n); }
+  return n;
+}
+
+size_t ChannelBase::tryGetBytes(uint8_t *dst, size_t n) {
+  ATOMIC { n = getNonAtomic(dst, n); }
+  return n;
+}
+
+void ChannelBase::putBytes(const uint8_t *src, size_t n) {
+  ATOMIC {
+    while (1) {
+      size_t done = putNonAtomic(src, n);
+      n -= done;
+      if (!n) return;
+      src += done * _elementSize;
+      sendVoid(&_putters);
+    }
+  }
+}
+
+void ChannelBase::getBytes(uint8_t *dst, size_t n) {
+  ATOMIC {
+    while (1) {
+      size_t done = getNonAtomic(dst, n);
+      n -= done;
+      if (!n) return;
+      dst += done * _elementSize;
+      sendVoid(&_getters);
+    }
+  }
+}
+
+}  // namespace lilos
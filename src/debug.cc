@@ -13,25 +13,46 @@
 namespace lilos {
 
 static bool _debuggingOn = false;
+static bool _panicking = false;
 
 #define CONDITIONAL if (!_debuggingOn) return;
 
+/*
+ * All output goes through these two, so that debugPanic() can switch it to
+ * polled mode.
+ */
+static void output(const uint8_t *src, size_t len) {
+  if (_panicking) {
+    while (len--) debugUsart.writeNow(*src++);
+  } else {
+    debugUsart.write(src, len);
+  }
+}
+
+static void output_P(const prog_char *src, size_t len) {
+  if (_panicking) {
+    while (len--) debugUsart.writeNow(pgm_read_byte(src++));
+  } else {
+    debugUsart.write_P(src, len);
+  }
+}
+
 void debugInit() {
-  debugUsart.initialize(kDebugBaudrate,
-                        USART::DATA_8, USART::PARITY_NONE, USART::STOP_1);
+  debugUsart.initialize<kDebugBaudrate>(USART::DATA_8, USART::PARITY_NONE,
+                                        USART::STOP_1);
   _debuggingOn = true;
 }
 
 void debugWrite(const char *str) {
   CONDITIONAL;
   size_t len = strlen(str);
-  debugUsart.write((const uint8_t *) str, len);
+  output((const uint8_t *) str, len);
 }
 
 void debugWrite_P(const prog_char *str) {
   CONDITIONAL;
   size_t len = strlen_P(str);
-  debugUsart.write_P(str, len);
+  output_P(str, len);
 }
 
 void debugWrite(uint32_t word) {
@@ -49,12 +70,29 @@ void debugWrite(uint32_t word) {
     word <<= 4;
   }
   buf[8] = ' ';
-  debugUsart.write((uint8_t *) buf, 9);
+  output((uint8_t *) buf, 9);
+}
+
+void debugWriteDec(uint32_t word) {
+  CONDITIONAL;
+  char buf[11];
+  char *p = buf + sizeof(buf);
+  *--p = ' ';
+  do {
+    *--p = '0' + word % 10;
+    word /= 10;
+  } while (word);
+  output((uint8_t *) p, buf + sizeof(buf) - p);
 }
 
 void debugLn() {
   CONDITIONAL;
-  debugUsart.write('\r');
+  static const uint8_t cr = '\r';
+  output(&cr, 1);
+}
+
+void debugPanic() {
+  _panicking = true;
 }
 
 }  // namespace lilos
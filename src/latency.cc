@@ -0,0 +1,106 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <string.h>
+
+#include <lilos/atomic.hh>
+#include <lilos/debug.hh>
+#include <lilos/latency.hh>
+#include <lilos/pgmspace.hh>
+
+#ifdef LILOS_LATENCY
+
+namespace lilos {
+
+bool latencyOpen = false;
+uint16_t latencyOffSince = 0;
+
+// Every site reached so far, most recent first.
+static LatencySite *sites = 0;
+
+static const prog_char kSwitchName[] PROGMEM = "context switch";
+static LatencySite switchSite = { kSwitchName, 0 };
+
+// When the current context switch began.
+static uint16_t switchStart;
+
+void latencyInit() {
+  latencyTimerInit();
+}
+
+void latencyRecord(LatencySite *site, uint16_t ticks) {
+  if (!site->listed) {
+    site->next = sites;
+    sites = site;
+    site->listed = true;
+  }
+
+  if (ticks > site->max) site->max = ticks;
+
+  uint8_t bucket = 0;
+  for (uint16_t t = ticks >> 1; t && bucket < kLatencyBuckets - 1; t >>= 1) {
+    bucket++;
+  }
+  if (site->histogram[bucket] != UINT16_MAX) site->histogram[bucket]++;
+}
+
+bool latencySwitchOut() {
+  bool open = latencyOpen;
+  switchStart = open ? latencyOffSince : latencyNow();
+  // A task that has never run starts with nothing open.
+  latencyOpen = false;
+  return open;
+}
+
+void latencySwitchIn(bool open) {
+  uint16_t now = latencyNow();
+  latencyRecord(&switchSite, now - switchStart);
+
+  // Any ATOMIC block we were switched out of resumes timing from here.
+  latencyOpen = open;
+  latencyOffSince = now;
+}
+
+void latencyReset() {
+  ATOMIC {
+    for (LatencySite *s = sites; s; s = s->next) {
+      s->max = 0;
+      memset(s->histogram, 0, sizeof(s->histogram));
+    }
+  }
+}
+
+void latencyDump() {
+  debugWrite_P(PSTR("--- latency (max, then histogram) ---\r"));
+
+  LatencySite *s;
+  ATOMIC { s = sites; }
+  for (; s; s = s->next) {
+    // Take a consistent copy; writing it out takes a while.
+    LatencySite copy;
+    ATOMIC { copy = *s; }
+
+    debugWrite_P(copy.file);
+    if (copy.line) {
+      debugWrite_P(PSTR(":"));
+      debugWrite((uint32_t) copy.line);
+    } else {
+      debugWrite_P(PSTR(" "));
+    }
+    debugWrite((uint32_t) copy.max);
+    debugWrite_P(PSTR("|"));
+    for (uint8_t i = 0; i < kLatencyBuckets; i++) {
+      debugWrite((uint32_t) copy.histogram[i]);
+    }
+    debugLn();
+  }
+
+  debugWrite_P(PSTR("--- end latency ---\r"));
+}
+
+}  // namespace lilos
+
+#endif  // LILOS_LATENCY
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <lilos/atomic.hh>
+#include <lilos/mailbox.hh>
+#include <lilos/task.hh>
+
+namespace lilos {
+
+Mailbox::Mailbox(msg_t *buffer, uint8_t capacity)
+  : _buffer(buffer),
+    _capacity(capacity),
+    _head(0),
+    _count(0) {}
+
+/*
+ * Delivers a message: directly to a waiting receiver if there is one, or into
+ * the buffer if there's room.  Returns false if there isn't.
+ */
+bool Mailbox::putNonAtomic(msg_t msg) {
+  Task *r = _receivers.headNonAtomic();
+  if (r) {
+    answer(r, msg);
+    return true;
+  }
+
+  uint8_t count = _count;
+  if (count == _capacity) return false;
+
+  // Wider than the index, since it can pass 255 before wrapping.
+  uint16_t tail = _head + count;
+  if (tail >= _capacity) tail -= _capacity;
+  _buffer[tail] = msg;
+  _count = count + 1;
+  return true;
+}
+
+/*
+ * Removes the oldest message, which must exist.  The space it frees goes to
+ * the first blocked sender, if any.
+ */
+msg_t Mailbox::takeNonAtomic() {
+  uint8_t head = _head;
+  msg_t msg = _buffer[head];
+  if (++head == _capacity) head = 0;
+  _head = head;
+  _count--;
+
+  Task *s = _senders.headNonAtomic();
+  if (s) {
+    putNonAtomic(s->message());
+    answerVoid(s);
+  }
+  return msg;
+}
+
+void Mailbox::post(msg_t msg) {
+  ATOMIC {
+    if (!putNonAtomic(msg)) send(&_senders, msg);
+  }
+}
+
+bool Mailbox::trySend(msg_t msg) {
+  bool sent;
+  ATOMIC { sent = putNonAtomic(msg); }
+  return sent;
+}
+
+msg_t Mailbox::receive() {
+  msg_t msg;
+  ATOMIC {
+    if (_count) {
+      msg = takeNonAtomic();
+    } else {
+      msg = sendVoid(&_receivers);
+    }
+  }
+  return msg;
+}
+
+bool Mailbox::tryReceive(msg_t *msg) {
+  bool received = false;
+  ATOMIC {
+    if (_count) {
+      *msg = takeNonAtomic();
+      received = true;
+    }
+  }
+  return received;
+}
+
+}  // namespace lilos
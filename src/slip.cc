@@ -0,0 +1,248 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <util/crc16.h>
+
+#include <lilos/atomic.hh>
+#include <lilos/slip.hh>
+#include <lilos/task.hh>
+
+namespace lilos {
+
+// SLIP special characters.
+static const uint8_t kEnd = 0xC0;
+static const uint8_t kEsc = 0xDB;
+static const uint8_t kEscEnd = 0xDC;
+static const uint8_t kEscEsc = 0xDD;
+
+static const uint16_t kCrcInitial = 0xFFFF;
+
+// States of the buffer not being filled.
+enum { kFree, kReady, kHeld };
+
+// Why the frame being received is being thrown away.
+enum { kKeep, kGarbled, kTooLong, kNoBuffer };
+
+static void count(volatile uint16_t *counter) {
+  if (*counter != UINT16_MAX) (*counter)++;
+}
+
+SlipLinkBase::SlipLinkBase(USART *usart, uint8_t *buffer0, uint8_t *buffer1,
+                           size_t capacity)
+  : _usart(usart),
+    _capacity(capacity),
+    _fill(0),
+    _other(kFree),
+    _pending(false),
+    _otherLength(0),
+    _pendingLength(0),
+    _crcErrors(0),
+    _dropped(0) {
+  _buffers[0] = buffer0;
+  _buffers[1] = buffer1;
+  restart();
+}
+
+void SlipLinkBase::attach() {
+  ATOMIC {
+    restart();
+    _usart->_link = this;
+  }
+}
+
+void SlipLinkBase::detach() {
+  ATOMIC { _usart->_link = 0; }
+}
+
+uint16_t SlipLinkBase::crcErrors() {
+  uint16_t n;
+  ATOMIC { n = _crcErrors; }
+  return n;
+}
+
+uint16_t SlipLinkBase::dropped() {
+  uint16_t n;
+  ATOMIC { n = _dropped; }
+  return n;
+}
+
+/*
+ * Receiving
+ */
+
+void SlipLinkBase::restart() {
+  _length = 0;
+  _crc = kCrcInitial;
+  _escape = false;
+  _discard = kKeep;
+}
+
+size_t SlipLinkBase::receive(const uint8_t **frame) {
+  size_t length;
+  ATOMIC {
+    // We're done with the last frame, so its buffer can take the next one --
+    // or, if a frame is waiting in the fill buffer, they swap.
+    if (_other == kHeld) {
+      _other = kFree;
+      if (_pending) {
+        _pending = false;
+        deliver(_pendingLength);
+      }
+    }
+    if (_other != kReady) sendVoid(&_receivers);
+
+    _other = kHeld;
+    *frame = _buffers[_fill ^ 1];
+    length = _otherLength;
+  }
+  return length;
+}
+
+/*
+ * Hands over the complete frame in the fill buffer, which swaps with the other
+ * (free) one, and wakes the receiver.
+ */
+void SlipLinkBase::deliver(size_t length) {
+  _otherLength = length;
+  _other = kReady;
+  _fill ^= 1;
+
+  Task *receiver = _receivers.headNonAtomic();
+  if (receiver) answerVoid(receiver);
+}
+
+/*
+ * The CRC is checked by running it over the frame's own CRC as well, which
+ * leaves zero if they match.
+ */
+void SlipLinkBase::endFrame() {
+  // Back-to-back ENDs are allowed, and are just padding.
+  if (!_length && _discard == kKeep) return;
+
+  if (_discard == kTooLong || _discard == kNoBuffer) {
+    count(&_dropped);
+  } else if (_discard == kGarbled || _escape || _length < 2 || _crc) {
+    count(&_crcErrors);
+  } else if (_other != kFree) {
+    // Keep it where it is until receive() frees the other buffer.
+    _pending = true;
+    _pendingLength = _length - 2;
+  } else {
+    deliver(_length - 2);
+  }
+  restart();
+}
+
+void SlipLinkBase::receiveFromISR(uint8_t data, bool lostBefore) {
+  if (lostBefore && _discard == kKeep) _discard = kGarbled;
+
+  if (data == kEnd) {
+    endFrame();
+    return;
+  }
+  // Both buffers are full.
+  if (_pending) _discard = kNoBuffer;
+  if (_discard != kKeep) return;
+
+  if (_escape) {
+    _escape = false;
+    if (data == kEscEnd) {
+      data = kEnd;
+    } else if (data == kEscEsc) {
+      data = kEsc;
+    } else {
+      _discard = kGarbled;
+      return;
+    }
+  } else if (data == kEsc) {
+    _escape = true;
+    return;
+  }
+
+  if (_length == _capacity) {
+    _discard = kTooLong;
+    return;
+  }
+  _buffers[_fill][_length++] = data;
+  _crc = _crc_xmodem_update(_crc, data);
+}
+
+/*
+ * Sending
+ */
+
+// The sender's frame, and where the transmit interrupt has got to in it.
+struct SlipLinkBase::TxFrame : USART::TxBlock {
+  enum { kStart, kData, kCrcHigh, kCrcLow, kDone };
+
+  uint16_t crc;
+  uint8_t phase;
+  uint8_t escaped;  // second byte of an escape, or 0
+};
+
+bool SlipLinkBase::encode(USART::TxBlock *block, uint8_t *out) {
+  TxFrame *f = static_cast<TxFrame *>(block);
+  if (f->escaped) {
+    *out = f->escaped;
+    f->escaped = 0;
+    return false;
+  }
+
+  uint8_t b;
+  switch (f->phase) {
+    case TxFrame::kStart:
+      // A leading END flushes any line noise out of the receiver.
+      *out = kEnd;
+      f->phase = f->length ? TxFrame::kData : TxFrame::kCrcHigh;
+      return false;
+
+    case TxFrame::kData:
+      b = *f->data++;
+      f->crc = _crc_xmodem_update(f->crc, b);
+      if (--f->length == 0) f->phase = TxFrame::kCrcHigh;
+      break;
+
+    case TxFrame::kCrcHigh:
+      b = f->crc >> 8;
+      f->phase = TxFrame::kCrcLow;
+      break;
+
+    case TxFrame::kCrcLow:
+      b = f->crc;
+      f->phase = TxFrame::kDone;
+      break;
+
+    default:
+      *out = kEnd;
+      return true;
+  }
+
+  if (b == kEnd) {
+    *out = kEsc;
+    f->escaped = kEscEnd;
+  } else if (b == kEsc) {
+    *out = kEsc;
+    f->escaped = kEscEsc;
+  } else {
+    *out = b;
+  }
+  return false;
+}
+
+void SlipLinkBase::send(const uint8_t *data, size_t length) {
+  TxFrame frame;
+  frame.data = data;
+  frame.length = length;
+  frame.flash = false;
+  frame.source = encode;
+  frame.crc = kCrcInitial;
+  frame.phase = TxFrame::kStart;
+  frame.escaped = 0;
+
+  ATOMIC { _usart->transmitBlock(&frame); }
+}
+
+}  // namespace lilos
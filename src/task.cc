@@ -4,36 +4,113 @@
  * http://creativecommons.org/licenses/by-sa/3.0/
  */
 
+#include <string.h>
 #include <util/atomic.h>
-#include <avr/sleep.h>
+#include <avr/interrupt.h>
 
+#include <lilos/arch.hh>
 #include <lilos/atomic.hh>
 #include <lilos/task.hh>
 #include <lilos/util.hh>
 #include <lilos/debug.hh>
+#include <lilos/latency.hh>
 #include <lilos/pgmspace.hh>
+#include <lilos/time.hh>
+#include <lilos/trace.hh>
 
 namespace lilos {
 
-// List containing all potentially runnable tasks.
-static TaskList readyList;
+// Lists containing all potentially runnable tasks, one per priority level.
+static TaskList readyLists[kPriorityLevels];
+
+// Bit N is set iff readyLists[N] is non-empty.
+static volatile uint8_t readyMask = 0;
 
 // List containing all tasks blocked at receive().
 static TaskList receiverList;
 
 // Pointer to currently executing task.
-static Task * volatile _currentTask = 0;
+Task * volatile _currentTask = 0;
+
+/*
+ * Wakeups from interrupt handlers
+ *
+ * ISRs never touch the ready lists.  Instead, answer() called with interrupts
+ * disabled takes the sender off the list it's waiting in and pushes it here,
+ * and the kernel makes it ready the next time it chooses a task to run.  The
+ * queue links through the tasks themselves, so it can't fill up.
+ *
+ * While a task is queued here, its _container is &pendingWakeList (so that it
+ * can't be answered or scheduled twice), _next links the queue, and _prev
+ * holds the owner of the list it was answered from, which may have borrowed
+ * its priority.
+ */
+static TaskList pendingWakeList;
+static Task * volatile pendingWakes = 0;
+
+/*
+ * The scheduler lock
+ *
+ * Kernel paths that change the ready lists or task priorities hold the
+ * scheduler lock, rather than disabling interrupts.  Because ISRs keep out of
+ * those structures, nothing else can get at them in cooperative builds, and
+ * the lock compiles to nothing.  In preemptive builds it keeps
+ * rescheduleFromISR() from switching tasks in the middle of an update; the
+ * last task out of the lock does any switching that was held up.
+ *
+ * The lock depth is part of each task's context, like the interrupt flag; see
+ * switchTo().
+ */
+#ifdef LILOS_PREEMPTIVE
+static volatile uint8_t schedulerLockDepth = 0;
+#ifdef LILOS_TIMESLICE
+// Set by the tick interrupt, when the current task's time is up.
+static volatile bool sliceExpired = false;
+#else
+static const bool sliceExpired = false;
+#endif
+
+static void releaseSchedulerLock();
+
+class SchedulerLock {
+public:
+  SchedulerLock() { schedulerLockDepth++; }
+  ~SchedulerLock() { releaseSchedulerLock(); }
+};
+#else
+class SchedulerLock {
+public:
+  SchedulerLock() {}
+};
+#endif
+
+#ifdef LILOS_CPU_STATS
+// Every Task, in order of construction, linked through _nextCreated.
+static Task *firstCreated = 0;
+static Task **createdTail = &firstCreated;
+
+// micros() at startTasking(), and when the current task was switched in.
+static uint32_t statsStart;
+static uint32_t runStart;
+
+// Time the idle task has spent in archIdle().
+static uint32_t idleSleep = 0;
+#endif
 
 /*
  * TaskList
  */
 
 Task *TaskList::head() {
-  ATOMIC { return _head; }
+  Task *t;
+  ATOMIC { t = _head; }
+  return t;
 }
 
 Task *TaskList::tail() {
-  ATOMIC { return _tail; }
+  Task *t;
+  ATOMIC { t = _tail; }
+  return t;
 }
 
 void TaskList::appendAtomic(Task *task) {
@@ -54,6 +131,43 @@ void TaskList::appendAtomic(Task *task) {
   }
 }
 
+void TaskList::insertAtomic(Task *task, Task *before) {
+  if (!before) {
+    appendAtomic(task);
+    return;
+  }
+
+  ATOMIC {
+    if (task->_container) return;
+
+    Task *p = before->_prev;  // Cache volatile field in a register.
+    task->_prev = p;
+    task->_next = before;
+    task->_container = this;
+
+    if (p) {
+      p->_next = task;
+    } else {
+      _head = task;
+    }
+    before->_prev = task;
+  }
+}
+
+bool TaskList::advance(Task **t) {
+  ATOMIC {
+    Task *c = *t;
+    if (!c) {
+      *t = _head;
+    } else if (c->_container == this) {
+      *t = c->_next;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
 void TaskList::removeAtomic(Task *task) {
   ATOMIC {
     if (task->_container != this) return;
@@ -77,127 +191,250 @@ void TaskList::removeAtomic(Task *task) {
  * Task
  */
 
-#define _PUSH(x) *(sp--) = (uint8_t) (x)
-static const uint8_t kSregIntEnabled = 0x80;
-Task::Task(main_t entry, uint8_t *stack, size_t stackSize)
+// Unused stack is filled with this, so that stackHighWater() can find it.
+static const uint8_t kStackPaint = 0xC5;
+// The lowest byte of each stack holds this, so that we can detect overflow.
+static const uint8_t kStackCanary = 0x3A;
+
+Task::Task(main_t entry, uint8_t *stack, size_t stackSize, priority_t priority)
   : _sp(0),
+    _stack(stack),
+    _stackSize(stackSize),
     _next(0),
-    _prev(0) {
-  uint8_t *sp = stack + stackSize - 1;
-
-  // Code "return address" of entry routine
-  uintptr_t code = (uintptr_t) entry;
-  _PUSH(code);
-  _PUSH(code >> 8);
-
-  // Registers
-  _PUSH(0);  // r0
-  _PUSH(kSregIntEnabled);  // SREG
-  _PUSH(0);  // r1
-  for (int i = 2; i <= 17; i++) {
-    _PUSH(i);
+    _prev(0),
+    _container(0),
+    _waiters(this),
+    _basePriority(priority < kPriorityLevels ? priority : kPriorityLevels - 1),
+    _priority(_basePriority)
+#ifdef LILOS_CPU_STATS
+    , _runTime(0),
+    _longestRun(0),
+    _switches(0),
+    _nextCreated(0)
+#endif
+    {
+  memset(stack, kStackPaint, stackSize);
+  stack[0] = kStackCanary;
+  _sp = archInitialContext(entry, stack, stackSize);
+
+#ifdef LILOS_CPU_STATS
+  ATOMIC {
+    *createdTail = this;
+    createdTail = &_nextCreated;
   }
-  _PUSH(28);
-  _PUSH(29);
+#endif
+}
 
-  _sp = sp;
+size_t Task::stackHighWater() {
+  size_t untouched = 1;  // Skip the canary.
+  while (untouched < _stackSize && _stack[untouched] == kStackPaint) {
+    untouched++;
+  }
+  return _stackSize - untouched;
 }
-#undef _PUSH
 
 Task *Task::next() {
-  ATOMIC { return _next; }
+  Task *t;
+  ATOMIC { t = _next; }
+  return t;
 }
 
 Task *Task::prev() {
-  ATOMIC { return _prev; }
+  Task *t;
+  ATOMIC { t = _prev; }
+  return t;
 }
 
+#ifdef LILOS_CPU_STATS
+uint32_t Task::runTime() {
+  uint32_t n;
+  ATOMIC { n = _runTime; }
+  return n;
+}
+
+uint32_t Task::longestRun() {
+  uint32_t n;
+  ATOMIC { n = _longestRun; }
+  return n;
+}
+
+uint32_t Task::switches() {
+  uint32_t n;
+  ATOMIC { n = _switches; }
+  return n;
+}
+
+Task *firstTask() { return firstCreated; }
+
+uint32_t cpuStatsElapsed() {
+  return micros() - statsStart;
+}
+
+uint32_t idleSleepTime() {
+  uint32_t n;
+  ATOMIC { n = idleSleep; }
+  return n;
+}
+
+// Charges the time since the last switch to the task being switched out.
+void chargeCurrentTask() {
+  uint32_t now = micros();
+  uint32_t run = now - runStart;
+  runStart = now;
+
+  Task *t = _currentTask;
+  ATOMIC {
+    t->_runTime += run;
+    t->_switches++;
+    if (run > t->_longestRun) t->_longestRun = run;
+  }
+}
+#endif
+
 void Task::detach() {
-  TaskList *c;
-  ATOMIC { c = _container; }
-  if (!c) return;
+  SchedulerLock lock;
+  TaskList *c = _container;
+  // Tasks in the pending queue belong to the scheduler until it's drained.
+  if (!c || c == &pendingWakeList) return;
   c->removeAtomic(this);
+
+  // Keep readyMask in sync if this empties a ready list.
+  if (c == &readyLists[_priority] && !c->headNonAtomic()) {
+    readyMask &= ~_BV(_priority);
+  }
 }
 
 
 /*
- * Context save/restore
- *
- * You might note that the functions below save only a subset of registers.
- * This is deliberate: these are the 'callee-save' registers under avr-gcc's
- * calling conventions.  We can rely on the compiler to save others before
- * entering yield() or startTasking().  This saves 48 cycles per task switch
- * on ATmega, 24 on xmega.
+ * Returns the member of the list that a new task of the given priority should
+ * be inserted before: after everyone at least as urgent.  The list is walked
+ * with interrupts enabled, so an ISR may answer the task returned before the
+ * caller can use it.  The scheduler lock must be held, so that no other task
+ * changes the list meanwhile.
+ */
+static Task *priorityPosition(TaskList *list, priority_t p) {
+  // Usually the new task is no more urgent than the last in line.
+  Task *t = list->tail();
+  if (!t || t->priority() >= p) return 0;
+
+  t = 0;
+  while (1) {
+    if (!list->advance(&t)) {
+      t = 0;  // An ISR answered the task we were at.  Start again.
+    } else if (!t || t->priority() < p) {
+      return t;
+    }
+  }
+}
+
+/*
+ * Puts a task in the list in priority order, moving it if it's already there
+ * ('moving').  Interrupts are only disabled to check that the place found is
+ * still good -- that an ISR hasn't answered the task we'd go before -- and to
+ * take it.  Returns false if the task was moving, but an ISR answered it
+ * first.  The scheduler lock must be held.
  */
+static bool placeByPriority(TaskList *list, Task *task, bool moving) {
+  priority_t p = task->priority();
+  while (1) {
+    Task *before = priorityPosition(list, p);
+    ATOMIC {
+      if (moving && !task->in(list)) return false;
+      if (!before || before->in(list)) {
+        if (moving) list->removeAtomic(task);
+        list->insertAtomic(task, before);
+        return true;
+      }
+    }
+  }
+}
 
-static ALWAYS_INLINE void saveContextAndDisableInterrupts(stack_t *spp) {
-  asm volatile (
-    "push r0 \n\t"
-    "in r0, __SREG__ \n\t"
-    "cli \n\t"
-    "push r0 \n\t"
-    "push r1 \n\t"
-    // Callee-saved registers
-    "push r2 \n\t"
-    "push r3 \n\t"
-    "push r4 \n\t"
-    "push r5 \n\t"
-    "push r6 \n\t"
-    "push r7 \n\t"
-    "push r8 \n\t"
-    "push r9 \n\t"
-    "push r10 \n\t"
-    "push r11 \n\t"
-    "push r12 \n\t"
-    "push r13 \n\t"
-    "push r14 \n\t"
-    "push r15 \n\t"
-    "push r16 \n\t"
-    "push r17 \n\t"
-    "push r28 \n\t"
-    "push r29 \n\t"
-    // Stack pointer
-    "in r0, __SP_L__ \n\t"
-    "st %a0, r0 \n\t"
-    "in r0, __SP_H__ \n\t"
-    "std %a0+1, r0 \n\t"
-  : /* no output */
-  : "b"(spp)
-  );
-}
-
-static ALWAYS_INLINE void restoreContext(stack_t sp) {
-  asm volatile (
-    // Stack pointer
-    "out __SP_L__, %A0 \n\t"
-    "out __SP_H__, %B0 \n\t"
-    // Callee-save registers
-    "pop r29  \n\t"
-    "pop r28  \n\t"
-    "pop r17  \n\t"
-    "pop r16  \n\t"
-    "pop r15  \n\t"
-    "pop r14  \n\t"
-    "pop r13  \n\t"
-    "pop r12  \n\t"
-    "pop r11  \n\t"
-    "pop r10  \n\t"
-    "pop r9  \n\t"
-    "pop r8  \n\t"
-    "pop r7  \n\t"
-    "pop r6  \n\t"
-    "pop r5  \n\t"
-    "pop r4  \n\t"
-    "pop r3  \n\t"
-    "pop r2  \n\t"
-    "pop r1  \n\t"
-    // SREG
-    "pop r0  \n\t"
-    "out __SREG__, r0  \n\t"
-    "pop r0 \n\t"
-  : /* no output */
-  : "r"(sp)
-  );
+// Adds a task to the ready list for its priority.  Hold the scheduler lock.
+static void makeReady(Task *task) {
+  TaskList *list = &readyLists[task->priority()];
+  list->appendAtomic(task);
+  if (task->in(list)) readyMask |= _BV(task->priority());
+}
+
+// The scheduler lock must be held.
+void Task::updatePriority() {
+  Task *t = this;
+  while (t) {
+    priority_t p = t->_basePriority;
+    Task *w = t->_waiters.head();
+    if (w && w->_priority > p) p = w->_priority;
+    if (p == t->_priority) return;
+
+    TaskList *c = t->_container;
+    if (c == &readyLists[t->_priority]) {
+      // Move to the ready list for the new priority.
+      t->detach();
+      t->_priority = p;
+      makeReady(t);
+      return;
+    }
+
+    t->_priority = p;
+    if (!c || !c->owner()) return;
+
+    // We're blocked sending to another task.  Keep its waiters in order, and
+    // see whether its priority needs to change too.  (If an ISR has answered
+    // us meanwhile, it still might: it has one waiter fewer.)
+    placeByPriority(c, t, true);
+    t = c->owner();
+  }
+}
+
+/*
+ * Queues a wakeup for a task answered with interrupts disabled; see
+ * pendingWakes.  Interrupts must be disabled.
+ */
+void wakeLater(Task *task) {
+  TaskList *c = task->_container;
+  // Ignore tasks that aren't waiting, or have already been answered.
+  if (!c || c == &pendingWakeList) return;
+  if (c >= readyLists && c < readyLists + kPriorityLevels) return;
+
+  Task *owner = c->owner();
+  c->removeAtomic(task);
+  task->_container = &pendingWakeList;
+  task->_prev = owner;
+  task->_next = pendingWakes;
+  pendingWakes = task;
+}
+
+/*
+ * Makes every task in the pending queue ready to run, in the order they were
+ * answered.  The scheduler lock must be held.
+ */
+void drainPendingWakes() {
+  if (!pendingWakes) return;
+
+  Task *t;
+  ATOMIC {
+    t = pendingWakes;
+    pendingWakes = 0;
+  }
+
+  // The queue is a stack; reverse it.
+  Task *fifo = 0;
+  while (t) {
+    Task *n = t->_next;
+    t->_next = fifo;
+    fifo = t;
+    t = n;
+  }
+
+  while ((t = fifo)) {
+    fifo = t->_next;
+    Task *owner = t->_prev;
+    t->_next = 0;
+    t->_prev = 0;
+    t->_container = 0;
+
+    makeReady(t);
+    if (owner) owner->updatePriority();
+  }
 }
 
 
@@ -206,71 +443,232 @@ static ALWAYS_INLINE void restoreContext(stack_t sp) {
  */
 
 void schedule(Task *task) {
-  readyList.appendAtomic(task);
+  SchedulerLock lock;
+  makeReady(task);
+}
+
+/*
+ * Highest set bit in each value of a nibble.  Indexing this with readyMask, a
+ * nibble at a time, finds the highest ready priority in constant time.
+ */
+static const uint8_t kHighestBit[16] PROGMEM = {
+  0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+};
+
+/*
+ * Finds the highest priority that has any ready tasks, once any pending
+ * wakeups are in line.  Because the idle task never blocks, there is always at
+ * least one.  The scheduler lock must be held.
+ */
+static priority_t highestReady_locked() {
+  drainPendingWakes();
+
+  uint8_t mask = readyMask;
+  if (mask & 0xF0) return 4 + pgm_read_byte(&kHighestBit[mask >> 4]);
+  return pgm_read_byte(&kHighestBit[mask]);
+}
+
+/*
+ * Picks the task that should run next: the first in line at the highest ready
+ * priority.  The scheduler lock must be held.
+ */
+static Task *nextTask_locked() {
+  return readyLists[highestReady_locked()].headNonAtomic();
+}
+
+/*
+ * Called just before the current task is switched out, to check that it hasn't
+ * overflowed its stack: that the context yieldTo() is about to save will fit
+ * above the canary, and the canary is intact.  This is inlined, and runs
+ * before the save, so that nothing is pushed on a stack that may already be
+ * full.
+ */
+static ALWAYS_INLINE void checkStack() {
+  Task *t = _currentTask;
+  uint8_t *base = t->stackBase();
+  if (archStackPointer() >= base + kArchSwitchFrame && *base == kStackCanary) {
+    return;
+  }
+
+  // The task's stack can't be trusted, and it may have trampled something
+  // else's.
+  cli();
+  archStackFault(t);
+}
+
+/*
+ * Switches to the given task, unless it's already running.  The scheduler
+ * lock must be held.
+ */
+static void switchTo(Task *next) {
+  if (next == _currentTask) return;
+
+#ifdef LILOS_CPU_STATS
+  chargeCurrentTask();
+#endif
+  trace(kTraceSwitch, (uintptr_t) next);
+
+#if defined(LILOS_PREEMPTIVE) || defined(LILOS_LATENCY)
+  ATOMIC {
+#ifdef LILOS_PREEMPTIVE
+    // The task we resume brings back the lock depth it was switched out with,
+    // in its own copy of this local; one that has never run starts with none.
+    uint8_t depth = schedulerLockDepth;
+    schedulerLockDepth = 0;
+#endif
+#ifdef LILOS_LATENCY
+    bool open = latencySwitchOut();
+#endif
+    checkStack();
+    yieldTo(next);
+#ifdef LILOS_LATENCY
+    latencySwitchIn(open);
+#endif
+#ifdef LILOS_PREEMPTIVE
+    schedulerLockDepth = depth;
+#endif
+  }
+#else
+  checkStack();
+  yieldTo(next);
+#endif
 }
 
-TASK(idleTask, 32) {
+TASK(idleTask, kIdleStackSize, kIdlePriority) {
   cli();
   while (1) {
-    if (_currentTask->nextNonAtomic() || _currentTask->prevNonAtomic()) {
+    if (readyMask != _BV(kIdlePriority) || pendingWakes
+        || _currentTask->nextNonAtomic() || _currentTask->prevNonAtomic()) {
       yield();
     } else {
-      sleep_enable();
-      sei();
-      sleep_cpu();
-      cli();
-      sleep_disable();
+#ifdef LILOS_CPU_STATS
+      uint32_t start = micros();
+      archIdle();
+      idleSleep += micros() - start;
+#else
+      archIdle();
+#endif
     }
   }
 }
 
 NORETURN startTasking() {
   schedule(&idleTask);
-  Task *c = readyList.head();
+  cli();
+  Task *c = nextTask_locked();
   _currentTask = c;
-  restoreContext(c->sp());
-  
-  // gcc is smart enough to recognize that this function does, in fact, return.
-  // The code below is a total hack to fool it into allowing NORETURN here.
-  // It adds two bytes to the output.
-  asm volatile ("ret");
-  while (1);
+#ifdef LILOS_CPU_STATS
+  statsStart = runStart = micros();
+#endif
+  archStartTasking(c);
 }
 
 
-Task *nextTask() {
-  Task *newTask = _currentTask->next();
-  if (!newTask) newTask = readyList.head();
-  return newTask;
+/*
+ * Sends the current task to the back of the line at its priority.  The
+ * scheduler lock must be held.
+ */
+static void requeueCurrentTask() {
+  Task *me = _currentTask;
+  TaskList *list = &readyLists[me->priority()];
+  if (me->in(list)) {
+    list->removeAtomic(me);
+    list->appendAtomic(me);
+  }
 }
 
-Task *nextTask_interruptsDisabled() {
-  Task *newTask = _currentTask->nextNonAtomic();
-  if (!newTask) newTask = readyList.headNonAtomic();
-  return newTask;
+void yield() {
+  SchedulerLock lock;
+  requeueCurrentTask();
+  switchTo(nextTask_locked());
 }
 
-NEVER_INLINE void yieldTo(Task *next) {
-  /*
-   * This is a bit of a hack.  We need somewhere to store the next task,
-   * without displacing the return address on the stack.  So, we stash it in
-   * this static variable.  Because yieldTo is not reentrant (by definition)
-   * this is safe -- we declare it 'volatile' only so the compiler doesn't get
-   * any big ideas about caching the contents in a register.
-   */
-  static Task * volatile _nextTask;
-  _nextTask = next;
+Task *currentTask() { return _currentTask; }
+
+/*
+ * Direct switches that have passed over tasks of the target's own priority
+ * since one last waited its turn.  Past kMaxHandOffs, a pair of tasks passing
+ * messages back and forth would be starving the rest of their priority.
+ */
+static const uint8_t kMaxHandOffs = 16;
+static uint8_t handOffs = 0;
 
-  saveContextAndDisableInterrupts(&_currentTask->sp());
-  _currentTask = _nextTask;
-  restoreContext(_currentTask->sp());
+/*
+ * Switches straight to a task that has just been made ready, without waiting
+ * for its turn -- unless something more urgent is ready, or it has jumped the
+ * line too often.  The scheduler lock must be held.
+ */
+static void handOffTo(Task *task) {
+  priority_t p = task->priority();
+  if (p < highestReady_locked()) {
+    task = nextTask_locked();
+  } else if (readyLists[p].headNonAtomic() != task) {
+    if (handOffs == kMaxHandOffs) {
+      handOffs = 0;
+      task = readyLists[p].headNonAtomic();
+    } else {
+      handOffs++;
+    }
+  }
+  switchTo(task);
 }
 
-void yield() {
-  yieldTo(nextTask());
+#ifdef LILOS_PREEMPTIVE
+/*
+ * Brings in any pending wakeups, ends the current time slice if it's up, and
+ * switches to whichever task is now most urgent.  The scheduler lock must be
+ * held, exactly once.
+ */
+static void preempt() {
+#ifdef LILOS_TIMESLICE
+  if (sliceExpired) {
+    sliceExpired = false;
+    requeueCurrentTask();
+  }
+#endif
+  switchTo(nextTask_locked());
 }
 
-Task *currentTask() { return _currentTask; }
+/*
+ * Whatever ISRs queued while the lock was held is dealt with before letting
+ * go.  The final check and release happen with interrupts disabled, so that
+ * nothing can be queued in between and then missed.
+ */
+static void releaseSchedulerLock() {
+  while (1) {
+    ATOMIC {
+      if (schedulerLockDepth > 1 || !_currentTask
+          || (!pendingWakes && !sliceExpired)) {
+        schedulerLockDepth--;
+        return;
+      }
+    }
+    preempt();
+  }
+}
+
+/*
+ * This runs with the interrupt handler's frame -- holding the registers
+ * yieldTo doesn't save -- on the interrupted task's stack.  Together they make
+ * up the task's full context.
+ */
+NEVER_INLINE void rescheduleFromISR() {
+  // Interrupts may arrive before startTasking().  If the interrupted task
+  // holds the scheduler lock, it will do this when it lets go.
+  if (!_currentTask || schedulerLockDepth) return;
+  if (!pendingWakes && !sliceExpired) return;
+
+  schedulerLockDepth = 1;
+  preempt();
+  schedulerLockDepth = 0;
+}
+#endif
+
+#ifdef LILOS_TIMESLICE
+void timeSliceFromISR() {
+  sliceExpired = true;
+}
+#endif
 
 
 /*
@@ -283,7 +681,6 @@ msg_t send(Task *target, msg_t message) {
 }
 
 msg_t sendVoid(Task *target) {
-  if (target->in(&receiverList)) answerVoid(target);
   return sendVoid(&target->waiters());
 }
 
@@ -292,37 +689,144 @@ msg_t send(TaskList *target, msg_t message) {
   return sendVoid(target);
 }
 
-msg_t sendVoid(TaskList *target) {
-  ATOMIC {
-    // Gotta do this and store the result before calling detach()
-    Task *next = nextTask_interruptsDisabled();
-  
-    _currentTask->detach();
-    target->appendAtomic(_currentTask);
+/*
+ * Moves the current task into the target list, before 'before'.  The
+ * scheduler lock must be held.
+ */
+static void enqueueCurrentTask(TaskList *target, Task *before) {
+  _currentTask->detach();
+  target->insertAtomic(_currentTask, before);
+}
 
-    yieldTo(next);
+/*
+ * Blocks the current task, which has just joined the target list, until it's
+ * answered.  The scheduler lock must be held.
+ */
+msg_t blockIn(TaskList *target) {
+  Task *next = 0;
+  Task *owner = target->owner();
+  if (target != &receiverList) {
+    trace(kTraceSend, owner ? (uintptr_t) owner : (uintptr_t) target);
+  }
+  if (owner) {
+    if (owner->in(&receiverList)) {
+      // The owner is blocked in receive(), waiting for us.  Rather than
+      // putting it at the back of the line, switch straight to it.
+      receiverList.removeAtomic(owner);
+      makeReady(owner);
+      next = owner;
+    }
+    owner->updatePriority();
+  }
 
-    return _currentTask->message();
+  if (next) {
+    handOffTo(next);
+  } else {
+    // If an ISR has already answered us, this may pick us again.
+    switchTo(nextTask_locked());
   }
+
+  return _currentTask->message();
+}
+
+msg_t sendVoid(TaskList *target) {
+  SchedulerLock lock;
+  _currentTask->detach();
+  placeByPriority(target, _currentTask, false);
+  return blockIn(target);
+}
+
+msg_t sendVoidBefore(TaskList *target, Task *before) {
+  SchedulerLock lock;
+  enqueueCurrentTask(target, before);
+  return blockIn(target);
 }
 
 Task *receive() {
+  // Senders must take the scheduler lock, so holding it while we check and
+  // block means none can slip in between and find us not yet listening.
+  SchedulerLock lock;
   do {
     Task *sender = _currentTask->waiters().head();
-    if (sender) return sender;
+    if (sender) {
+      trace(kTraceReceive, (uintptr_t) sender);
+      return sender;
+    }
 
     sendVoid(&receiverList);
   } while (1);
 }
 
+Task *replyAndReceive(Task *sender, msg_t response) {
+  sender->setMessage(response);
+  trace(kTraceAnswer, (uintptr_t) sender);
+
+  {
+    SchedulerLock lock;
+    Task *me = _currentTask;
+    sender->detach();
+    makeReady(sender);
+    me->updatePriority();
+
+    Task *next = me->waiters().head();
+    if (next) {
+      // Keep serving -- unless the client we just answered is more urgent than
+      // everyone still waiting.
+      if (sender->priority() > me->priority()) {
+        requeueCurrentTask();
+        handOffTo(sender);
+        next = me->waiters().head();
+      }
+      if (next) {
+        trace(kTraceReceive, (uintptr_t) next);
+        return next;
+      }
+    } else {
+      // Nobody else is waiting.  Block for the next client, and give the CPU
+      // straight to this one in the meantime, unless something more urgent
+      // is ready.
+      me->detach();
+      receiverList.appendAtomic(me);
+      handOffTo(sender);
+    }
+  }
+  return receive();
+}
+
 void answer(Task *sender, msg_t response) {
   sender->setMessage(response);
   answerVoid(sender);
 }
 
 void answerVoid(Task *sender) {
+  trace(kTraceAnswer, (uintptr_t) sender);
+
+  // ISRs (and tasks in critical sections) run with interrupts disabled.  They
+  // mustn't be switched away from, or touch the ready lists; leave the sender
+  // for the scheduler.
+  if (!archInterruptsEnabled()) {
+    wakeLater(sender);
+    return;
+  }
+
+  SchedulerLock lock;
+
+  // If the sender was lending its priority to someone, take it back.
+  TaskList *c = sender->_container;
+  Task *owner = c ? c->owner() : 0;
+
   sender->detach();
-  schedule(sender);
+  makeReady(sender);
+  if (!owner) return;
+  owner->updatePriority();
+
+  // If we're answering our own client, hand the CPU straight back to it --
+  // unless we're now more urgent than it is.
+  if (owner == _currentTask
+      && sender->priority() >= _currentTask->priority()) {
+    requeueCurrentTask();
+    handOffTo(sender);
+  }
 }
 
 
@@ -334,24 +838,21 @@ void dump1(Task *task, uint8_t indentLevel) {
   while (indentLevel--) {
     debugWrite_P(PSTR("  "));
   }
-  debugWrite((uint32_t) task);
+  debugWrite((uint32_t) (uintptr_t) task);
   debugWrite_P(PSTR(" sp="));
-  debugWrite((uint32_t) task->sp());
+  debugWrite((uint32_t) (uintptr_t) task->sp());
+  debugWrite_P(PSTR("pri="));
+  debugWrite((uint32_t) task->priority());
+  size_t used = task->stackHighWater();
+  debugWrite_P(PSTR("used="));
+  debugWrite((uint32_t) used);
+  debugWrite_P(PSTR("free="));
+  debugWrite((uint32_t) (task->stackSize() - used));
   if (task == _currentTask) {
     debugWrite_P(PSTR("(you are here)"));
   } else {
     debugWrite_P(PSTR("pc="));
-    union {
-      struct {
-        uint8_t lo;
-        uint8_t hi;
-      } bytes;
-      uint16_t pc;
-    };
-    uint8_t *pcp = task->sp() + 22;  /* 21-byte context + 1-byte offset */
-    bytes.lo = pcp[1];
-    bytes.hi = pcp[0];
-    debugWrite(pc);
+    debugWrite((uint32_t) archSavedPC(task));
   }
   debugLn();
 
@@ -360,20 +861,49 @@ void dump1(Task *task, uint8_t indentLevel) {
   }
 }
 
+__attribute__((weak)) NORETURN stackOverflow(Task *task) {
+  debugPanic();
+  debugWrite_P(PSTR("--- stack overflow ---\r"));
+  dump1(task, 0);
+  while (1);
+}
+
 void taskDump() {
   debugWrite_P(PSTR("--- task dump ---\r"));
 
   debugWrite_P(PSTR("Current: "));
-  debugWrite((uint32_t) _currentTask);
+  debugWrite((uint32_t) (uintptr_t) _currentTask);
   debugLn();
 
   debugWrite_P(PSTR("All:\r"));
-  Task *t = readyList.head();
-  while (t) {
-    dump1(t, 1);
-    t = t->next();
+  for (priority_t p = kPriorityLevels; p-- > 0; ) {
+    for (Task *t = readyLists[p].head(); t; t = t->next()) {
+      dump1(t, 1);
+    }
   }
 
+#ifdef LILOS_CPU_STATS
+  // A top-style summary: time in microseconds, and share of the CPU.
+  uint32_t elapsed = cpuStatsElapsed();
+  uint32_t hundredth = elapsed / 100 ? elapsed / 100 : 1;
+  debugWrite_P(PSTR("CPU: task, pri, %, time, switches, longest run\r"));
+  for (Task *t = firstTask(); t; t = t->nextCreated()) {
+    uint32_t time = t->runTime();
+    debugWrite_P(PSTR("  "));
+    debugWrite((uint32_t) (uintptr_t) t);
+    debugWriteDec(t->priority());
+    debugWriteDec(time / hundredth);
+    debugWriteDec(time);
+    debugWriteDec(t->switches());
+    debugWriteDec(t->longestRun());
+    debugLn();
+  }
+  debugWrite_P(PSTR("  asleep "));
+  debugWriteDec(idleSleepTime() / hundredth);
+  debugWriteDec(idleSleepTime());
+  debugLn();
+#endif
+
   debugWrite_P(PSTR("--- end task dump ---\r"));
 }
 
@@ -4,55 +4,142 @@
  * http://creativecommons.org/licenses/by-sa/3.0/
  */
 
-#include <avr/io.h>
-
 #include <lilos/atomic.hh>
 #include <lilos/time.hh>
 #include <lilos/task.hh>
-#include <lilos/limits.hh>
+#include <lilos/trace.hh>
 
 namespace lilos {
 
-static uint32_t timerTicks = 0;
-static TaskList timerTaskList;
+/*
+ * Tasks blocked in sleepUntil, in order of deadline.  Each task's message slot
+ * points at its deadline.  Because the list is sorted, the timer only ever has
+ * to look at the first task.
+ */
+static TaskList sleepList;
+
+static uint32_t deadlineOf(Task *t) {
+  return *t->message<uint32_t *>();
+}
+
+// Alarms that are set, in order of deadline.
+static Alarm *alarms = 0;
 
 /*
- * The timerTask wakes up once per millisecond (see the ISR at the end of this
- * file) and looks for expired deadlines.  It wakes up any tasks it finds.
+ * Each expiry costs the same, no matter how many tasks are asleep.
+ *
+ * Must be called with interrupts disabled.
  */
-TASK(timerTask, kMinStack + 16) {
-  Task *me = currentTask();
-  while (1) {
-    Task *t = me->waiters().head();
-    uint32_t time = ticks();
-    while (t) {
-      Task *next = t->next();  // Cache this in case we answer and change it.
-      uint32_t deadline = *t->message<uint32_t *>();
-      // Hack: we assume that no deadline will be 2^30 milliseconds from now.
-      if (time - deadline < numeric_limits<int32_t>::max / 2) answerVoid(t);
-      t = next;
+void timerExpired() {
+  while (true) {
+    Task *t = sleepList.headNonAtomic();
+    Alarm *a = alarms;
+    if (!t && !a) return;
+
+    // Whichever is due first; tasks win ties.
+    if (t && (!a || (int32_t) (deadlineOf(t) - a->_deadline) <= 0)) {
+      if (timerArm(deadlineOf(t))) return;
+      trace(kTraceWake, (uintptr_t) t);
+      answerVoid(t);
+    } else {
+      if (timerArm(a->_deadline)) return;
+      alarms = a->_next;
+      a->_set = false;
+      a->_expired(a->_context);
     }
-    sendVoid(&timerTaskList);
   }
 }
 
-void timeInit() {
-  TCCR2A = 2;  // CTC mode
-  TCCR2B = 6;  // clk/256
-  TIMSK2 = _BV(OCIE2A);  // interrupt on match
-  OCR2A = F_CPU / 1000 / 256 - 1;
-
-  timerTaskList.appendAtomic(&timerTask);
+/*
+ * Finds the first sleeper due after the deadline, so that tasks with equal
+ * deadlines wake in FIFO order.  There may be many sleepers, so the list is
+ * walked with interrupts enabled, a step at a time.  If the sleeper we're at
+ * is woken meanwhile, so were all those before it; start again.
+ */
+static Task *sleepPosition(uint32_t deadline) {
+  Task *t = 0;
+  while (1) {
+    if (!sleepList.advance(&t)) {
+      t = 0;
+    } else if (!t || (int32_t) (deadlineOf(t) - deadline) > 0) {
+      return t;
+    }
+  }
 }
 
-uint32_t ticks() {
-  ATOMIC {
-    return timerTicks;
+/*
+ * Checks that a sleeper due at the deadline can still go before 'before' (or
+ * last, if it's NULL), keeping the list in order.  Meanwhile, the timer may
+ * have woken 'before' -- which may even have gone back to sleep -- or another
+ * task may have taken the place in front of it.  Interrupts must be disabled.
+ */
+static bool fitsBefore(Task *before, uint32_t deadline) {
+  Task *prev;
+  if (before) {
+    if (!before->in(&sleepList)
+        || (int32_t) (deadlineOf(before) - deadline) <= 0) {
+      return false;
+    }
+    prev = before->prevNonAtomic();
+  } else {
+    prev = sleepList.tailNonAtomic();
   }
+  return !prev || (int32_t) (deadlineOf(prev) - deadline) <= 0;
 }
 
 void sleepUntil(uint32_t deadline) {
-  sendPtr(&timerTask, &deadline);
+  while (1) {
+    Task *before = sleepPosition(deadline);
+
+    ATOMIC {
+      if ((int32_t) (ticks() - deadline) >= 0) return;
+
+      if (fitsBefore(before, deadline)) {
+        // If we're going first, the timer needs to know -- unless an Alarm
+        // is due sooner, in which case it's armed already.
+        if (before == sleepList.headNonAtomic()
+            && (!alarms || (int32_t) (deadline - alarms->_deadline) < 0)
+            && !timerArm(deadline)) {
+          return;
+        }
+
+        currentTask()->setMessage(&deadline);
+        sendVoidBefore(&sleepList, before);
+        return;
+      }
+    }
+  }
+}
+
+Alarm::Alarm(void (*expired)(void *), void *context)
+: _next(0),
+  _deadline(0),
+  _set(false),
+  _expired(expired),
+  _context(context) {}
+
+// Linear in the number of Alarms set, with interrupts disabled; see time.hh.
+void Alarm::set(uint32_t deadline) {
+  cancel();
+
+  Alarm **p = &alarms;
+  while (*p && (int32_t) ((*p)->_deadline - deadline) <= 0) p = &(*p)->_next;
+  _next = *p;
+  _deadline = deadline;
+  _set = true;
+  *p = this;
+
+  // If we're first, rearm the timer -- or fire now, if it's too late.
+  if (alarms == this) timerExpired();
+}
+
+void Alarm::cancel() {
+  if (!_set) return;
+  Alarm **p = &alarms;
+  while (*p != this) p = &(*p)->_next;
+  *p = _next;
+  _set = false;
+  // The timer may still be armed for us.  A spurious expiry is harmless.
 }
 
 IntervalTimer::IntervalTimer(uint16_t interval)
@@ -65,12 +152,3 @@ void IntervalTimer::wait() {
 }
 
 }  // namespace lilos
-
-using namespace lilos;
-
-void TIMER2_COMPA_vect() {
-  timerTicks++;
-  // Check to see if the timerTask is waiting for us.  If so, unblock it.
-  Task *tt = timerTaskList.headNonAtomic();
-  if (tt) answerVoid(tt);
-}
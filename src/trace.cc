@@ -0,0 +1,101 @@
+/*
+ * Copyright 2011 Cliff L. Biffle.
+ * Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ */
+
+#include <lilos/atomic.hh>
+#include <lilos/static_assert.hh>
+#include <lilos/time.hh>
+#include <lilos/trace.hh>
+#include <lilos/usart.hh>
+#include <lilos/board_debug.hh>
+
+#ifdef LILOS_TRACE
+
+namespace lilos {
+
+static const uint8_t kTraceEvents = LILOS_TRACE_EVENTS;
+
+struct TraceRecord {
+  uint32_t time;
+  uint8_t event;
+  uint16_t argument;
+};
+
+// The ring buffer: count records, oldest first, starting at ring[first].
+static TraceRecord ring[kTraceEvents];
+static uint8_t first = 0;
+static uint8_t count = 0;
+
+// Events overwritten or skipped since the last frame.
+static uint16_t lost = 0;
+static bool streaming = false;
+
+void trace(TraceEvent event, uintptr_t argument) {
+  static_assert(TraceEventsOutOfRange,
+                LILOS_TRACE_EVENTS > 0 && LILOS_TRACE_EVENTS <= 255);
+
+  ATOMIC {
+    if (streaming) {
+      if (lost != UINT16_MAX) lost++;
+      return;
+    }
+
+    uint16_t i = first + count;  // can pass 255 before wrapping
+    if (i >= kTraceEvents) i -= kTraceEvents;
+    if (count == kTraceEvents) {
+      // Full: overwrite the oldest.
+      if (++first == kTraceEvents) first = 0;
+      if (lost != UINT16_MAX) lost++;
+    } else {
+      count++;
+    }
+
+    TraceRecord *r = &ring[i];
+    r->time = micros();
+    r->event = event;
+    r->argument = argument;
+  }
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+  *p++ = v;
+  *p++ = v >> 8;
+  return p;
+}
+
+void traceStream() {
+  uint8_t n;
+  uint8_t header[8] = { 'L', 'T', 'R', 'C', 1 };
+  ATOMIC {
+    streaming = true;
+    n = count;
+    header[5] = n;
+    put16(&header[6], lost);
+    lost = 0;
+  }
+  debugUsart.write(header, sizeof(header));
+
+  while (n--) {
+    TraceRecord r;
+    ATOMIC {
+      r = ring[first];
+      if (++first == kTraceEvents) first = 0;
+      count--;
+    }
+
+    uint8_t buf[7];
+    uint8_t *p = put16(buf, r.time);
+    p = put16(p, r.time >> 16);
+    *p++ = r.event;
+    put16(p, r.argument);
+    debugUsart.write(buf, sizeof(buf));
+  }
+
+  ATOMIC { streaming = false; }
+}
+
+}  // namespace lilos
+
+#endif  // LILOS_TRACE
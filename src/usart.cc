@@ -5,58 +5,224 @@
  */
 
 
-#include <avr/io.h>
 #include <stddef.h>
 
 #include <lilos/usart.hh>
+#include <lilos/slip.hh>
 #include <lilos/task.hh>
+#include <lilos/time.hh>
 
 namespace lilos {
 
+static const uint8_t kRxMask = kUsartRxBuffer - 1;
+static const uint8_t kTxMask = kUsartTxBuffer - 1;
+
+bool USART::available() {
+  return _rxCount != 0;
+}
+
+/*
+ * A buffer lent to the receive interrupt by a reader waiting in
+ * _receiveTasks.  The interrupt stores bytes straight into it, and answers the
+ * reader once it's full, the delimiter arrives, or the timeout passes.
+ *
+ * The timeout only runs once a byte has arrived, and only for the reader at
+ * the head of the queue -- the only one receiving anything.
+ */
+struct USART::RxBlock {
+  uint8_t *data;
+  size_t count;
+  size_t max;
+  int16_t delim;     // -1 for none
+  uint16_t timeout;  // 0 for none
+  uint32_t last;     // when the last byte arrived
+
+  // Stores a byte, returning true if the read is complete.
+  bool put(uint8_t b) {
+    data[count++] = b;
+    return count == max || b == delim;
+  }
+};
+
+uint8_t USART::takeNonAtomic() {
+  uint8_t b = _rxBuffer[_rxHead];
+  _rxHead = (_rxHead + 1) & kRxMask;
+  if (_rxCount-- == kUsartRxBuffer && _resumeReceiving) _resumeReceiving();
+  return b;
+}
+
 uint8_t USART::read() {
+  uint8_t b;
   ATOMIC {
-    if (available()) return readNow();
-
-    return sendVoid(&_receiveTasks);
+    if (_rxCount) return takeNonAtomic();
   }
+  receive(&b, 1, -1, 0);
+  return b;
 }
 
-void USART::write(const uint8_t *src, size_t len) {
-  for (size_t i = 0; i < len; i++) {
-    write(src[i]);
+size_t USART::read(uint8_t *buf, size_t n, uint16_t timeout) {
+  return receive(buf, n, -1, timeout);
+}
+
+size_t USART::readUntil(uint8_t *buf, size_t max, uint8_t delim,
+                        uint16_t timeout) {
+  return receive(buf, max, delim, timeout);
+}
+
+size_t USART::receive(uint8_t *buf, size_t max, int16_t delim,
+                      uint16_t timeout) {
+  RxBlock block = { buf, 0, max, delim, timeout, 0 };
+  if (!max) return 0;
+
+  ATOMIC {
+    // Readers only wait while the buffer is empty, so anything in it is ours.
+    while (_rxCount) {
+      if (block.put(takeNonAtomic())) return block.count;
+    }
+
+    // Readers queue in order, so a read's bytes are never split with another.
+    // If we got some bytes, we're first, and the timeout starts now.
+    if (block.count && timeout) {
+      block.last = ticks();
+      _rxAlarm.set(block.last + timeout);
+      if (!_rxAlarm.isSet()) return block.count;
+    }
+
+    currentTask()->setMessage(&block);
+    sendVoidBefore(&_receiveTasks, 0);
   }
+  return block.count;
 }
 
-void USART::write_P(const prog_char *src, size_t len) {
-  for (size_t i = 0; i < len; i++) {
-    write(pgm_read_byte(&src[i]));
+void USART::rxTimeout(void *context) {
+  USART *usart = static_cast<USART *>(context);
+  Task *reader = usart->_receiveTasks.headNonAtomic();
+  if (!reader) return;
+
+  // Bytes arriving only note the time; this catches up with them.
+  RxBlock *block = reader->message<RxBlock *>();
+  uint32_t deadline = block->last + block->timeout;
+  if ((int32_t) (ticks() - deadline) < 0) {
+    usart->_rxAlarm.set(deadline);
+  } else {
+    answerVoid(reader);
   }
 }
 
+uint16_t USART::rxOverruns() {
+  uint16_t n;
+  ATOMIC { n = _rxOverruns; }
+  return n;
+}
+
 void USART::write(uint8_t b) {
+  transmit(&b, 1, false);
+}
+
+void USART::write(const uint8_t *src, size_t len) {
+  transmit(src, len, false);
+}
+
+void USART::write_P(const prog_char *src, size_t len) {
+  transmit(reinterpret_cast<const uint8_t *>(src), len, true);
+}
+
+void USART::transmit(const uint8_t *src, size_t len, bool flash) {
+  if (!len) return;
+
   ATOMIC {
-    activateTransmission();
-    send(&_transmitTasks, b);
+    _startTransmitting();
+
+    // Writes that fit are copied, so the writer can carry on.  Anything else
+    // waits its turn, behind earlier writers.
+    size_t room = kUsartTxBuffer - _txCount;
+    if (!_transmitTasks.headNonAtomic() && len <= room) {
+      while (len--) {
+        _txBuffer[(_txHead + _txCount) & kTxMask] =
+            flash ? pgm_read_byte(src) : *src;
+        _txCount++;
+        src++;
+      }
+      return;
+    }
+
+    TxBlock block = { src, len, flash, 0 };
+    transmitBlock(&block);
   }
 }
 
-bool USART::senderWaiting() {
-  return _transmitTasks.headNonAtomic() != 0;
+void USART::transmitBlock(TxBlock *block) {
+  _startTransmitting();
+  // Writers queue in order, so a block is never split by another.
+  currentTask()->setMessage(block);
+  sendVoidBefore(&_transmitTasks, 0);
 }
 
-uint8_t USART::readAndUnblockSender() {
-  Task *sender = _transmitTasks.headNonAtomic();
-  uint8_t data = sender->message();
-  answerVoid(sender);
-  return data;
+bool USART::transmitFromISR(uint8_t *data) {
+  static_assert(TxBufferSizeMustBeAPowerOfTwo,
+                kUsartTxBuffer && !(kUsartTxBuffer & kTxMask)
+                && kUsartTxBuffer <= 128);
+
+  if (_txCount) {
+    *data = _txBuffer[_txHead];
+    _txHead = (_txHead + 1) & kTxMask;
+    _txCount--;
+    return true;
+  }
+
+  Task *writer = _transmitTasks.headNonAtomic();
+  if (!writer) return false;
+
+  TxBlock *block = writer->message<TxBlock *>();
+  bool last;
+  if (block->source) {
+    last = block->source(block, data);
+  } else {
+    *data = block->flash ? pgm_read_byte(block->data) : *block->data;
+    block->data++;
+    last = --block->length == 0;
+  }
+  if (last) answerVoid(writer);
+  return true;
+}
+
+void USART::countOverrun() {
+  if (_rxOverruns != UINT16_MAX) _rxOverruns++;
 }
 
-bool USART::receiverWaiting() {
-  return _receiveTasks.headNonAtomic() != 0;
+bool USART::rxBufferFull() {
+  return _rxCount == kUsartRxBuffer;
 }
 
-void USART::unblockReceiver(uint8_t data) {
-  answer(_receiveTasks.headNonAtomic(), data);
+void USART::receiveFromISR(uint8_t data, bool lostBefore) {
+  static_assert(RxBufferSizeMustBeAPowerOfTwo,
+                kUsartRxBuffer && !(kUsartRxBuffer & kRxMask)
+                && kUsartRxBuffer <= 128);
+
+  if (lostBefore) countOverrun();
+
+  if (_link) {
+    _link->receiveFromISR(data, lostBefore);
+    return;
+  }
+
+  // A task only waits in read() once the buffer is empty.
+  Task *reader = _receiveTasks.headNonAtomic();
+  if (reader) {
+    RxBlock *block = reader->message<RxBlock *>();
+    if (block->put(data)) {
+      answerVoid(reader);
+      _rxAlarm.cancel();
+    } else if (block->timeout) {
+      block->last = ticks();
+      if (block->count == 1) _rxAlarm.set(block->last + block->timeout);
+    }
+  } else if (_rxCount == kUsartRxBuffer) {
+    countOverrun();
+  } else {
+    _rxBuffer[(_rxHead + _rxCount) & kRxMask] = data;
+    _rxCount++;
+  }
 }
 
 }  // namespace lilos
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+#
+# Copyright 2011 Cliff L. Biffle.
+# Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+# http://creativecommons.org/licenses/by-sa/3.0/
+#
+"""Runs the LILOS kernel microbenchmarks under simavr.
+
+Runs the benchmark firmware (bench/bench.cc), collects the "BENCH name cycles"
+lines it prints on the USART, measures the program's flash and RAM use with
+avr-size, and prints everything as a single JSON object:
+
+  {"mcu": ..., "f_cpu": ..., "flash": ..., "ram": ..., "cycles": {...}}
+
+Exits non-zero if the firmware doesn't finish.
+"""
+
+import argparse
+import json
+import re
+import subprocess
+import sys
+
+BENCH_RE = re.compile(r'BENCH (\w+) (\d+)')
+ANSI_RE = re.compile(r'\x1b\[[0-9;]*m')
+
+
+def run_simavr(simavr, mcu, f_cpu, elf, timeout):
+    try:
+        out = subprocess.run([simavr, '-m', mcu, '-f', str(f_cpu), elf],
+                             stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                             universal_newlines=True, timeout=timeout).stdout
+    except subprocess.TimeoutExpired as e:
+        out = e.stdout or ''
+        if isinstance(out, bytes):
+            out = out.decode('latin-1')
+    results = {}
+    for line in ANSI_RE.sub('', out).splitlines():
+        m = BENCH_RE.search(line)
+        if m:
+            results[m.group(1)] = int(m.group(2))
+    return results
+
+
+def program_size(size, elf):
+    """Returns (flash, ram) in bytes, from avr-size's section listing."""
+    out = subprocess.check_output([size, '-A', elf], universal_newlines=True)
+    sections = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[1].isdigit():
+            sections[fields[0]] = int(fields[1])
+    text = sections.get('.text', 0)
+    data = sections.get('.data', 0)
+    bss = sections.get('.bss', 0) + sections.get('.noinit', 0)
+    return text + data, data + bss
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('elf')
+    parser.add_argument('--simavr', default='simavr')
+    parser.add_argument('--size', default='avr-size')
+    parser.add_argument('--mmcu', required=True)
+    parser.add_argument('--f-cpu', type=int, required=True)
+    parser.add_argument('--timeout', type=float, default=60)
+    args = parser.parse_args()
+
+    cycles = run_simavr(args.simavr, args.mmcu, args.f_cpu, args.elf,
+                        args.timeout)
+    finished = cycles.pop('done', None) is not None
+    flash, ram = program_size(args.size, args.elf)
+
+    json.dump({
+        'mcu': args.mmcu,
+        'f_cpu': args.f_cpu,
+        'flash': flash,
+        'ram': ram,
+        'cycles': cycles,
+    }, sys.stdout, indent=2, sort_keys=True)
+    sys.stdout.write('\n')
+
+    if not finished:
+        sys.stderr.write('%s: benchmark did not finish\n' % args.elf)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
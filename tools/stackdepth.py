@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+#
+# Copyright 2011 Cliff L. Biffle.
+# Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+# http://creativecommons.org/licenses/by-sa/3.0/
+#
+"""Worst-case stack depth analysis for LILOS tasks.
+
+Combines the per-function frame sizes that gcc writes with -fstack-usage
+(.su files) with the call graph disassembled from the linked ELF, and works
+out how much stack each TASK can need:
+
+  - the deepest call chain from the task's entry function (nameMain),
+    counting the return address pushed by each call;
+  - the context frame that saveContextAndDisableInterrupts pushes when the
+    task is switched out -- and, in preemptive builds, the register frame of
+    the interrupt handler it was switched out from;
+  - the deepest interrupt handler, which can fire at any point and runs on
+    the interrupted task's stack.
+
+Tasks are found by looking for pairs of symbols named fooStack and fooMain,
+as generated by the TASK macro.
+
+Writes a report to stdout and, optionally, a header defining STACK_SIZE_foo
+for each task, which can be used as TASK(foo, STACK_SIZE_foo).
+
+Indirect calls and recursion can't be bounded this way; they're reported,
+and the affected tasks are marked.
+"""
+
+import argparse
+import re
+import subprocess
+import sys
+
+# Bytes pushed by saveContextAndDisableInterrupts (r0, SREG, r1, r2-r17,
+# r28, r29).  Keep this in sync with arch/avr/src/arch_task.cc.
+CONTEXT_BYTES = 21
+
+# In preemptive builds (recognized by rescheduleFromISR being linked in), a
+# task can be switched out from inside an interrupt handler, leaving the
+# handler's own pushes under the context: r0, SREG, r1, and the call-clobbered
+# r18-r27, r30 and r31, all of which a handler that calls out must save.
+# They're counted here in case the handler's .su entry leaves them out.
+PREEMPT_FRAME_BYTES = 15
+PREEMPT_MARKER = 'lilos::rescheduleFromISR'
+
+# Bytes of return address pushed by call/rcall, and by interrupt entry.
+# (Three on parts with more than 128KiB of flash.)
+RETURN_BYTES = 2
+
+FUNC_RE = re.compile(r'^[0-9a-f]+ <(.+)>:$')
+CALL_RE = re.compile(r'\t(r?call|r?jmp)\t.*; 0x[0-9a-f]+ <([^>]+)>$')
+INDIRECT_RE = re.compile(r'\t(e?icall|e?ijmp)\b')
+
+
+def function_key(name):
+    """Reduces a demangled function name to its qualified name.
+
+    .su files and objdump spell parameter types differently (typedefs vs.
+    underlying types), and .su names include the return type, so we match on
+    the qualified name alone.  Overloads get merged, conservatively.
+    """
+    name = re.sub(r' \[clone [^\]]*\]', '', name)
+    depth = 0
+    for i, c in enumerate(name):
+        if c == '<':
+            depth += 1
+        elif c == '>':
+            depth -= 1
+        elif c == '(' and depth == 0:
+            name = name[:i]
+            break
+    # Drop the return type, if any: everything up to the last top-level space.
+    depth = 0
+    start = 0
+    for i, c in enumerate(name):
+        if c == '<':
+            depth += 1
+        elif c == '>':
+            depth -= 1
+        elif c == ' ' and depth == 0:
+            start = i + 1
+    return name[start:]
+
+
+def read_stack_usage(paths):
+    frames = {}
+    for path in paths:
+        with open(path) as f:
+            for line in f:
+                fields = line.rstrip('\n').split('\t')
+                if len(fields) < 3:
+                    continue
+                location, size, kind = fields[0], int(fields[1]), fields[2]
+                # location is file:line:column:function
+                name = location.split(':', 3)[3]
+                key = function_key(name)
+                frames[key] = max(frames.get(key, 0), size)
+    return frames
+
+
+def read_call_graph(objdump, elf):
+    out = subprocess.check_output([objdump, '-d', '-C', elf],
+                                  universal_newlines=True)
+    calls = {}
+    indirect = set()
+    current = None
+    for line in out.splitlines():
+        m = FUNC_RE.match(line)
+        if m:
+            current = function_key(m.group(1))
+            calls.setdefault(current, set())
+            continue
+        if current is None:
+            continue
+        m = CALL_RE.search(line)
+        if m:
+            target = m.group(2)
+            # Branches within a function show up as <name+0x1a>.
+            if '+0x' not in target:
+                target = function_key(target)
+                if target != current:
+                    calls[current].add(target)
+            continue
+        if INDIRECT_RE.search(line):
+            indirect.add(current)
+    return calls, indirect
+
+
+def read_symbols(nm, elf):
+    """Returns {symbol: size} for sized data and text symbols."""
+    out = subprocess.check_output([nm, '-C', '-S', elf],
+                                  universal_newlines=True)
+    symbols = {}
+    for line in out.splitlines():
+        fields = line.split(None, 3)
+        if len(fields) == 4:
+            symbols[fields[3]] = int(fields[1], 16)
+    return symbols
+
+
+class Analysis(object):
+    def __init__(self, frames, calls, indirect):
+        self.frames = frames
+        self.calls = calls
+        self.indirect = indirect
+        self.memo = {}
+        self.unknown = set()
+
+    def depth(self, func, active=()):
+        """Returns (bytes, path, problems) for the deepest chain from func."""
+        if func in self.memo:
+            return self.memo[func]
+        if func in active:
+            return 0, [func], {'recursion via ' + func}
+
+        if func not in self.frames and func in self.calls:
+            self.unknown.add(func)
+        frame = self.frames.get(func, 0)
+        problems = set()
+        if func in self.indirect:
+            problems.add('indirect call in ' + func)
+
+        best, best_path = 0, []
+        for callee in sorted(self.calls.get(func, ())):
+            d, path, p = self.depth(callee, active + (func,))
+            problems |= p
+            if d + RETURN_BYTES > best:
+                best, best_path = d + RETURN_BYTES, path
+
+        result = (frame + best, [func] + best_path, problems)
+        if not active or not problems:
+            self.memo[func] = result
+        return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('elf')
+    parser.add_argument('su', nargs='+', help='.su files from -fstack-usage')
+    parser.add_argument('--objdump', default='avr-objdump')
+    parser.add_argument('--nm', default='avr-nm')
+    parser.add_argument('--header', help='write recommended sizes here')
+    parser.add_argument('--margin', type=int, default=0,
+                        help='extra bytes to add to each recommendation')
+    args = parser.parse_args()
+
+    frames = read_stack_usage(args.su)
+    calls, indirect = read_call_graph(args.objdump, args.elf)
+    symbols = read_symbols(args.nm, args.elf)
+    analysis = Analysis(frames, calls, indirect)
+
+    # Interrupts can arrive anywhere, so the deepest one counts against
+    # every task.
+    isr_depth, isr_path, isr_problems = 0, [], set()
+    for func in sorted(calls):
+        if func.startswith('__vector_') and func != '__vector_default':
+            d, path, problems = analysis.depth(func)
+            isr_problems |= problems
+            if d + RETURN_BYTES > isr_depth:
+                isr_depth, isr_path = d + RETURN_BYTES, path
+
+    context = CONTEXT_BYTES
+    if PREEMPT_MARKER in calls:
+        context += PREEMPT_FRAME_BYTES
+
+    tasks = []
+    for sym, size in sorted(symbols.items()):
+        if not sym.endswith('Stack'):
+            continue
+        entry = sym[:-len('Stack')] + 'Main'
+        if entry not in calls:
+            continue
+        d, path, problems = analysis.depth(entry)
+        total = d + context + isr_depth
+        tasks.append((sym[:-len('Stack')], size, d, total, path,
+                      problems | isr_problems))
+
+    print('%-24s %6s %6s %6s %6s %8s' %
+          ('task', 'calls', 'ctx', 'isr', 'total', 'current'))
+    for name, size, d, total, path, problems in tasks:
+        flag = '  !' if total > size else ''
+        if problems:
+            flag += '  (unbounded)'
+        print('%-24s %6d %6d %6d %6d %8d%s' %
+              (name, d, context, isr_depth, total, size, flag))
+    print()
+    print('Deepest interrupt: %s' % ' -> '.join(isr_path))
+    for name, size, d, total, path, problems in tasks:
+        print('%s: %s' % (name, ' -> '.join(path)))
+        for p in sorted(problems):
+            print('  warning: %s' % p)
+    if analysis.unknown:
+        print()
+        print('No stack usage information (counted as 0): %s' %
+              ', '.join(sorted(analysis.unknown)))
+
+    if args.header:
+        with open(args.header, 'w') as f:
+            f.write('// Generated by tools/stackdepth.py from %s.\n' % args.elf)
+            f.write('// Do not edit; run "make stack-report" instead.\n\n')
+            f.write('#ifndef LILOS_STACK_SIZES_HH_\n')
+            f.write('#define LILOS_STACK_SIZES_HH_\n\n')
+            for name, size, d, total, path, problems in tasks:
+                macro = 'STACK_SIZE_' + name.split('::')[-1]
+                f.write('#define %s %d\n' % (macro, total + args.margin))
+            f.write('\n#endif  // LILOS_STACK_SIZES_HH_\n')
+
+    return 1 if any(t[3] > t[1] for t in tasks) else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
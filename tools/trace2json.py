@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+#
+# Copyright 2011 Cliff L. Biffle.
+# Released under the Creative Commons Attribution-ShareAlike 3.0 License:
+# http://creativecommons.org/licenses/by-sa/3.0/
+#
+"""Converts LILOS scheduler traces into Chrome/Perfetto trace JSON.
+
+Reads the output of a TRACE=1 build -- as captured from the debug USART, or
+from stdout of a host build -- finds the frames written by traceStream(), and
+writes a JSON timeline for chrome://tracing or ui.perfetto.dev:
+
+  - each task gets a track, with a slice for each stretch it ran;
+  - sends, receives and answers are instant events on the running task's
+    track, naming the other task;
+  - interrupts and sleep wakeups are instant events on an "interrupts" track;
+  - gaps where events were lost are marked.
+
+Anything between frames (text from the debug API, say) is ignored.  See
+include/lilos/trace.hh for the frame format.
+
+  make BOARD=host TRACE=1 && ./main_host.elf > capture.bin
+  tools/trace2json.py capture.bin > trace.json
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b'LTRC'
+HEADER = struct.Struct('<4sBBH')
+EVENT = struct.Struct('<IBH')
+
+SWITCH, SEND, RECEIVE, ANSWER, INTERRUPT, WAKE = range(1, 7)
+
+IRQ_NAMES = {
+    0: 'timer overflow',
+    1: 'timer match',
+    2: 'usart rx',
+    3: 'usart tx',
+    4: 'time slice',
+}
+
+PID = 1
+IRQ_TID = 0
+
+
+def read_frames(data):
+    """Yields (lost, [(time, event, argument), ...]) for each frame."""
+    pos = 0
+    while True:
+        pos = data.find(MAGIC, pos)
+        if pos < 0 or pos + HEADER.size > len(data):
+            return
+        magic, version, count, lost = HEADER.unpack_from(data, pos)
+        end = pos + HEADER.size + count * EVENT.size
+        if version != 1 or end > len(data):
+            pos += 1
+            continue
+        events = [EVENT.unpack_from(data, pos + HEADER.size + i * EVENT.size)
+                  for i in range(count)]
+        yield lost, events
+        pos = end
+
+
+def task_name(arg):
+    return 'task %04x' % arg
+
+
+class Converter:
+    def __init__(self):
+        self.out = []
+        self.tasks = set()
+        self.running = None  # (task, start)
+        self.base = 0        # for unwrapping 32-bit microseconds
+        self.last = None
+        self.now = 0
+
+    def unwrap(self, t):
+        if self.last is not None and self.last - t > 0x80000000:
+            self.base += 1 << 32
+        self.last = t
+        self.now = self.base + t
+        return self.now
+
+    def instant(self, tid, ts, name, args=None):
+        e = {'ph': 'i', 's': 't', 'pid': PID, 'tid': tid, 'ts': ts,
+             'name': name}
+        if args:
+            e['args'] = args
+        self.out.append(e)
+
+    def end_slice(self, ts):
+        if self.running:
+            task, start = self.running
+            self.out.append({'ph': 'X', 'pid': PID, 'tid': task,
+                             'ts': start, 'dur': max(ts - start, 0),
+                             'name': 'running'})
+            self.running = None
+
+    def frame(self, lost, events):
+        if lost and events:
+            ts = self.unwrap(events[0][0])
+            self.instant(IRQ_TID, ts, '%d events lost' % lost)
+            # We no longer know what's running.
+            self.end_slice(ts)
+        for time, event, arg in events:
+            ts = self.unwrap(time)
+            current = self.running[0] if self.running else IRQ_TID
+            if event == SWITCH:
+                self.end_slice(ts)
+                self.tasks.add(arg)
+                self.running = (arg, ts)
+            elif event in (SEND, RECEIVE, ANSWER):
+                name = {SEND: 'send', RECEIVE: 'receive', ANSWER: 'answer'}
+                self.instant(current, ts, name[event],
+                             {'task': task_name(arg)})
+            elif event == INTERRUPT:
+                self.instant(IRQ_TID, ts,
+                             'irq ' + IRQ_NAMES.get(arg, str(arg)))
+            elif event == WAKE:
+                self.instant(IRQ_TID, ts, 'wake', {'task': task_name(arg)})
+                self.tasks.add(arg)
+
+    def finish(self):
+        self.end_slice(self.now)
+        meta = [{'ph': 'M', 'pid': PID, 'name': 'process_name',
+                 'args': {'name': 'lilos'}},
+                {'ph': 'M', 'pid': PID, 'tid': IRQ_TID, 'name': 'thread_name',
+                 'args': {'name': 'interrupts'}}]
+        for t in sorted(self.tasks):
+            meta.append({'ph': 'M', 'pid': PID, 'tid': t,
+                         'name': 'thread_name', 'args': {'name': task_name(t)}})
+        return {'traceEvents': meta + self.out, 'displayTimeUnit': 'ms'}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('capture', nargs='?', default='-',
+                        help='captured output (default: stdin)')
+    args = parser.parse_args()
+
+    if args.capture == '-':
+        data = sys.stdin.buffer.read()
+    else:
+        with open(args.capture, 'rb') as f:
+            data = f.read()
+
+    conv = Converter()
+    frames = 0
+    for lost, events in read_frames(data):
+        conv.frame(lost, events)
+        frames += 1
+    if not frames:
+        print('No trace frames found.', file=sys.stderr)
+        return 1
+
+    json.dump(conv.finish(), sys.stdout)
+    sys.stdout.write('\n')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())